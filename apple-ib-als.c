@@ -0,0 +1,689 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Apple Ambient Light Sensor Driver
+ *
+ * Copyright (c) 2017-2018 Ronald Tschalär
+ */
+
+/*
+ * MacBookPro models with an iBridge chip (13,[23] and 14,[23]) have an
+ * ambient light sensor that is exposed via one of the USB interfaces on the
+ * iBridge as a standard HID light sensor. However, we cannot use the
+ * existing hid-sensor-als driver, for two reasons:
+ *
+ * 1. The hid-sensor-als driver is part of the hid-sensor-hub which in turn
+ *    is a hid driver, but you can't have more than one hid driver per hid
+ *    device, which is a problem because the touch bar also needs to
+ *    register as a driver for this hid device. The apple-ibridge driver
+ *    solves this by creating a virtual hid device for the ALS collection,
+ *    which this driver attaches to.
+ * 2. Reads of the sysfs in_illuminance_raw attribute in hid-sensor-als
+ *    result in a GET_REPORT being sent to the device, i.e. the sensor is
+ *    polled, and iio-sensor-proxy polls rather frequently. This driver
+ *    instead streams the readings the sensor reports via interrupt into an
+ *    iio buffer, and sysfs reads are answered from the last such
+ *    reading whenever reporting is enabled.
+ *
+ * Userspace that only cares about it getting darker or brighter can instead
+ * set rising and/or falling threshold events on the illuminance channel;
+ * the readings are then compared against the thresholds right here in the
+ * HID event path, and userspace is only woken when one is crossed.
+ */
+
+#define dev_fmt(fmt) "als: " fmt
+
+#include <linux/device.h>
+#include <linux/hid.h>
+#include <linux/hid-sensor-ids.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/events.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+
+#include "apple-ibridge.h"
+
+#define APPLEALS_DEF_REPORT_INTERVAL	100	/* ms */
+
+struct appleals_device {
+	struct hid_device	*hid_dev;
+	struct hid_field	*illum_field;
+	struct hid_field	*report_state_field;
+	struct hid_field	*power_state_field;
+	struct hid_field	*report_interval_field;
+	struct iio_dev		*iio_dev;
+	struct iio_trigger	*iio_trig;
+
+	/* protects the following fields */
+	spinlock_t		lock;
+	u32			last_illum;
+	bool			have_sample;
+	bool			buffer_enabled;
+	u32			thresh_rising;
+	u32			thresh_falling;
+	bool			rising_enabled;
+	bool			falling_enabled;
+};
+
+static const struct iio_event_spec appleals_events[] = {
+	{
+		.type = IIO_EV_TYPE_THRESH,
+		.dir = IIO_EV_DIR_RISING,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE) |
+				 BIT(IIO_EV_INFO_ENABLE),
+	},
+	{
+		.type = IIO_EV_TYPE_THRESH,
+		.dir = IIO_EV_DIR_FALLING,
+		.mask_separate = BIT(IIO_EV_INFO_VALUE) |
+				 BIT(IIO_EV_INFO_ENABLE),
+	},
+};
+
+static const struct iio_chan_spec appleals_channels[] = {
+	{
+		.type = IIO_LIGHT,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),
+		.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SAMP_FREQ),
+		.scan_index = 0,
+		.scan_type = {
+			.sign = 'u',
+			.realbits = 32,
+			.storagebits = 32,
+			.endianness = IIO_CPU,
+		},
+		.event_spec = appleals_events,
+		.num_event_specs = ARRAY_SIZE(appleals_events),
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(1),
+};
+
+/**
+ * appleals_find_report_field() - Find the field in the report with the given
+ * usage.
+ * @report: the report to search
+ * @field_usage: the usage of the field to search for
+ *
+ * Returns: the hid field if found, or NULL if none found.
+ */
+static struct hid_field *appleals_find_report_field(struct hid_report *report,
+						    unsigned int field_usage)
+{
+	int f, u;
+
+	for (f = 0; f < report->maxfield; f++) {
+		struct hid_field *field = report->field[f];
+
+		if (field->logical == field_usage)
+			return field;
+
+		for (u = 0; u < field->maxusage; u++) {
+			if (field->usage[u].hid == field_usage)
+				return field;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * appleals_find_hid_field() - Search all the reports of the device for the
+ * field with the given usage.
+ * @hdev: the device whose reports to search
+ * @application: the usage of application collection that the field must
+ *               belong to
+ * @field_usage: the usage of the field to search for
+ *
+ * Returns: the hid field if found, or NULL if none found.
+ */
+static struct hid_field *appleals_find_hid_field(struct hid_device *hdev,
+						 unsigned int application,
+						 unsigned int field_usage)
+{
+	static const int report_types[] = { HID_INPUT_REPORT, HID_OUTPUT_REPORT,
+					    HID_FEATURE_REPORT };
+	struct hid_report *report;
+	struct hid_field *field;
+	int t;
+
+	for (t = 0; t < ARRAY_SIZE(report_types); t++) {
+		struct list_head *report_list =
+			    &hdev->report_enum[report_types[t]].report_list;
+		list_for_each_entry(report, report_list, list) {
+			if (report->application != application)
+				continue;
+
+			field = appleals_find_report_field(report, field_usage);
+			if (field)
+				return field;
+		}
+	}
+
+	return NULL;
+}
+
+static int appleals_set_field(struct appleals_device *als_dev,
+			      struct hid_field *field, s32 value)
+{
+	int rc;
+
+	rc = hid_set_field(field, 0, value);
+	if (rc) {
+		dev_err(&als_dev->hid_dev->dev,
+			"Failed to set field value (%d)\n", rc);
+		return rc;
+	}
+
+	hid_hw_request(als_dev->hid_dev, field->report, HID_REQ_SET_REPORT);
+	hid_hw_wait(als_dev->hid_dev);
+
+	return 0;
+}
+
+static int appleals_set_reporting(struct appleals_device *als_dev, bool on)
+{
+	struct hid_field *field = als_dev->report_state_field;
+	s32 state = on ? HID_USAGE_SENSOR_PROP_REPORTING_STATE_ALL_EVENTS_ENUM :
+			 HID_USAGE_SENSOR_PROP_REPORTING_STATE_NO_EVENTS_ENUM;
+
+	return appleals_set_field(als_dev, field, field->logical_minimum + state);
+}
+
+static int appleals_set_power(struct appleals_device *als_dev, bool on)
+{
+	struct hid_field *field = als_dev->power_state_field;
+	s32 state = on ? HID_USAGE_SENSOR_PROP_POWER_STATE_D0_FULL_POWER_ENUM :
+			 HID_USAGE_SENSOR_PROP_POWER_STATE_D4_POWER_OFF_ENUM;
+
+	return appleals_set_field(als_dev, field, field->logical_minimum + state);
+}
+
+static bool appleals_reporting_needed(struct appleals_device *als_dev)
+{
+	return als_dev->buffer_enabled || als_dev->rising_enabled ||
+	       als_dev->falling_enabled;
+}
+
+static int appleals_update_reporting(struct appleals_device *als_dev)
+{
+	unsigned long flags;
+	bool on;
+
+	spin_lock_irqsave(&als_dev->lock, flags);
+	on = appleals_reporting_needed(als_dev);
+	if (!on)
+		als_dev->have_sample = false;
+	spin_unlock_irqrestore(&als_dev->lock, flags);
+
+	return appleals_set_reporting(als_dev, on);
+}
+
+static int appleals_hid_event(struct hid_device *hdev, struct hid_field *field,
+			      struct hid_usage *usage, __s32 value)
+{
+	struct appleals_device *als_dev = hid_get_drvdata(hdev);
+	struct {
+		u32 illum;
+		s64 ts __aligned(8);
+	} scan = { };
+	unsigned long flags;
+	bool rising = false;
+	bool falling = false;
+	bool push;
+	u32 illum = max(value, 0);
+	u32 prev;
+	s64 ts;
+
+	if (usage->hid != HID_USAGE_SENSOR_LIGHT_ILLUM)
+		return 0;
+
+	spin_lock_irqsave(&als_dev->lock, flags);
+
+	prev = als_dev->last_illum;
+	ts = iio_get_time_ns(als_dev->iio_dev);
+
+	/* only report actual crossings, not every reading beyond a threshold */
+	if (als_dev->have_sample) {
+		rising = als_dev->rising_enabled &&
+			 prev <= als_dev->thresh_rising &&
+			 illum > als_dev->thresh_rising;
+		falling = als_dev->falling_enabled &&
+			  prev >= als_dev->thresh_falling &&
+			  illum < als_dev->thresh_falling;
+	}
+
+	als_dev->last_illum = illum;
+	als_dev->have_sample = true;
+	push = als_dev->buffer_enabled;
+
+	spin_unlock_irqrestore(&als_dev->lock, flags);
+
+	if (rising)
+		iio_push_event(als_dev->iio_dev,
+			       IIO_UNMOD_EVENT_CODE(IIO_LIGHT, 0,
+						    IIO_EV_TYPE_THRESH,
+						    IIO_EV_DIR_RISING),
+			       ts);
+	if (falling)
+		iio_push_event(als_dev->iio_dev,
+			       IIO_UNMOD_EVENT_CODE(IIO_LIGHT, 0,
+						    IIO_EV_TYPE_THRESH,
+						    IIO_EV_DIR_FALLING),
+			       ts);
+
+	/*
+	 * Push the sample directly, like hid-sensor-als does: this may run in
+	 * softirq or process context, where iio_trigger_poll() can't be used.
+	 */
+	if (push) {
+		scan.illum = illum;
+		iio_push_to_buffers_with_timestamp(als_dev->iio_dev, &scan, ts);
+	}
+
+	return 0;
+}
+
+/* The trigger is only used to enable and disable reporting. */
+static int appleals_set_trigger_state(struct iio_trigger *trig, bool state)
+{
+	struct appleals_device *als_dev = iio_trigger_get_drvdata(trig);
+	unsigned long flags;
+
+	spin_lock_irqsave(&als_dev->lock, flags);
+	als_dev->buffer_enabled = state;
+	spin_unlock_irqrestore(&als_dev->lock, flags);
+
+	return appleals_update_reporting(als_dev);
+}
+
+static const struct iio_trigger_ops appleals_trigger_ops = {
+	.set_trigger_state = appleals_set_trigger_state,
+};
+
+static int appleals_read_illum(struct appleals_device *als_dev, int *val)
+{
+	struct hid_device *hdev = als_dev->hid_dev;
+	unsigned long flags;
+	bool have_sample;
+
+	spin_lock_irqsave(&als_dev->lock, flags);
+	have_sample = als_dev->have_sample && appleals_reporting_needed(als_dev);
+	*val = als_dev->last_illum;
+	spin_unlock_irqrestore(&als_dev->lock, flags);
+
+	if (have_sample)
+		return IIO_VAL_INT;
+
+	/* nobody is streaming, so do a one-off poll */
+	hid_hw_request(hdev, als_dev->illum_field->report, HID_REQ_GET_REPORT);
+	hid_hw_wait(hdev);
+
+	spin_lock_irqsave(&als_dev->lock, flags);
+	*val = als_dev->last_illum;
+	spin_unlock_irqrestore(&als_dev->lock, flags);
+
+	return IIO_VAL_INT;
+}
+
+static int appleals_read_raw(struct iio_dev *iio_dev,
+			     struct iio_chan_spec const *chan,
+			     int *val, int *val2, long mask)
+{
+	struct appleals_device *als_dev = iio_priv(iio_dev);
+	s32 interval;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		return appleals_read_illum(als_dev, val);
+
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		interval = als_dev->report_interval_field->value[0];
+		if (interval <= 0)
+			return -EINVAL;
+		*val = 1000 / interval;
+		*val2 = (1000 % interval) * 1000000 / interval;
+		return IIO_VAL_INT_PLUS_MICRO;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static int appleals_write_raw(struct iio_dev *iio_dev,
+			      struct iio_chan_spec const *chan,
+			      int val, int val2, long mask)
+{
+	struct appleals_device *als_dev = iio_priv(iio_dev);
+	struct hid_field *field = als_dev->report_interval_field;
+	u64 freq_micro;
+	s32 interval;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_SAMP_FREQ:
+		if (val < 0 || val2 < 0)
+			return -EINVAL;
+
+		freq_micro = (u64)val * 1000000 + val2;
+		if (!freq_micro)
+			return -EINVAL;
+
+		interval = clamp_t(s64, div64_u64(1000000000ULL, freq_micro),
+				   field->logical_minimum,
+				   field->logical_maximum);
+
+		return appleals_set_field(als_dev, field, interval);
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static int appleals_read_event_config(struct iio_dev *iio_dev,
+				      const struct iio_chan_spec *chan,
+				      enum iio_event_type type,
+				      enum iio_event_direction dir)
+{
+	struct appleals_device *als_dev = iio_priv(iio_dev);
+
+	switch (dir) {
+	case IIO_EV_DIR_RISING:
+		return als_dev->rising_enabled;
+	case IIO_EV_DIR_FALLING:
+		return als_dev->falling_enabled;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int appleals_write_event_config(struct iio_dev *iio_dev,
+				       const struct iio_chan_spec *chan,
+				       enum iio_event_type type,
+				       enum iio_event_direction dir,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+				       bool state)
+#else
+				       int state)
+#endif
+{
+	struct appleals_device *als_dev = iio_priv(iio_dev);
+	unsigned long flags;
+
+	spin_lock_irqsave(&als_dev->lock, flags);
+
+	switch (dir) {
+	case IIO_EV_DIR_RISING:
+		als_dev->rising_enabled = !!state;
+		break;
+	case IIO_EV_DIR_FALLING:
+		als_dev->falling_enabled = !!state;
+		break;
+	default:
+		spin_unlock_irqrestore(&als_dev->lock, flags);
+		return -EINVAL;
+	}
+
+	spin_unlock_irqrestore(&als_dev->lock, flags);
+
+	return appleals_update_reporting(als_dev);
+}
+
+static int appleals_read_event_value(struct iio_dev *iio_dev,
+				     const struct iio_chan_spec *chan,
+				     enum iio_event_type type,
+				     enum iio_event_direction dir,
+				     enum iio_event_info info,
+				     int *val, int *val2)
+{
+	struct appleals_device *als_dev = iio_priv(iio_dev);
+
+	if (info != IIO_EV_INFO_VALUE)
+		return -EINVAL;
+
+	switch (dir) {
+	case IIO_EV_DIR_RISING:
+		*val = als_dev->thresh_rising;
+		return IIO_VAL_INT;
+	case IIO_EV_DIR_FALLING:
+		*val = als_dev->thresh_falling;
+		return IIO_VAL_INT;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int appleals_write_event_value(struct iio_dev *iio_dev,
+				      const struct iio_chan_spec *chan,
+				      enum iio_event_type type,
+				      enum iio_event_direction dir,
+				      enum iio_event_info info,
+				      int val, int val2)
+{
+	struct appleals_device *als_dev = iio_priv(iio_dev);
+	unsigned long flags;
+	int rc = 0;
+
+	if (info != IIO_EV_INFO_VALUE || val < 0)
+		return -EINVAL;
+
+	spin_lock_irqsave(&als_dev->lock, flags);
+
+	switch (dir) {
+	case IIO_EV_DIR_RISING:
+		als_dev->thresh_rising = val;
+		break;
+	case IIO_EV_DIR_FALLING:
+		als_dev->thresh_falling = val;
+		break;
+	default:
+		rc = -EINVAL;
+		break;
+	}
+
+	spin_unlock_irqrestore(&als_dev->lock, flags);
+
+	return rc;
+}
+
+static const struct iio_info appleals_info = {
+	.read_raw = appleals_read_raw,
+	.write_raw = appleals_write_raw,
+	.read_event_config = appleals_read_event_config,
+	.write_event_config = appleals_write_event_config,
+	.read_event_value = appleals_read_event_value,
+	.write_event_value = appleals_write_event_value,
+	/* reporting is switched by our trigger, so no other may be used */
+	.validate_trigger = iio_validate_own_trigger,
+};
+
+static int appleals_config_iio(struct appleals_device *als_dev)
+{
+	struct hid_device *hdev = als_dev->hid_dev;
+	struct iio_dev *iio_dev = als_dev->iio_dev;
+	struct iio_trigger *iio_trig;
+	int rc;
+
+	iio_dev->dev.parent = &hdev->dev;
+	iio_dev->name = "als";
+	iio_dev->modes = INDIO_DIRECT_MODE;
+	iio_dev->info = &appleals_info;
+	iio_dev->channels = appleals_channels;
+	iio_dev->num_channels = ARRAY_SIZE(appleals_channels);
+
+	rc = devm_iio_triggered_buffer_setup(&hdev->dev, iio_dev,
+					     &iio_pollfunc_store_time, NULL,
+					     NULL);
+	if (rc) {
+		dev_err(&hdev->dev, "Failed to set up iio triggers (%d)\n", rc);
+		return rc;
+	}
+
+	iio_trig = devm_iio_trigger_alloc(&hdev->dev, "als-%s",
+					  dev_name(&hdev->dev));
+	if (!iio_trig)
+		return -ENOMEM;
+
+	iio_trig->dev.parent = &hdev->dev;
+	iio_trig->ops = &appleals_trigger_ops;
+	iio_trigger_set_drvdata(iio_trig, als_dev);
+
+	rc = devm_iio_trigger_register(&hdev->dev, iio_trig);
+	if (rc) {
+		dev_err(&hdev->dev, "Failed to register iio trigger (%d)\n",
+			rc);
+		return rc;
+	}
+
+	als_dev->iio_trig = iio_trig;
+	iio_dev->trig = iio_trigger_get(iio_trig);
+
+	return 0;
+}
+
+static int appleals_init_sensor(struct appleals_device *als_dev)
+{
+	struct hid_device *hdev = als_dev->hid_dev;
+	int rc;
+
+	/* read the current config */
+	hid_hw_request(hdev, als_dev->report_interval_field->report,
+		       HID_REQ_GET_REPORT);
+	hid_hw_wait(hdev);
+
+	rc = appleals_set_power(als_dev, true);
+	if (rc)
+		return rc;
+
+	if (als_dev->report_interval_field->value[0] <= 0) {
+		rc = appleals_set_field(als_dev, als_dev->report_interval_field,
+					APPLEALS_DEF_REPORT_INTERVAL);
+		if (rc)
+			return rc;
+	}
+
+	/* no interrupt traffic until someone asks for it */
+	return appleals_set_reporting(als_dev, false);
+}
+
+static int appleals_probe(struct hid_device *hdev,
+			  const struct hid_device_id *id)
+{
+	struct appleals_device *als_dev;
+	struct iio_dev *iio_dev;
+	int rc;
+
+	rc = hid_parse(hdev);
+	if (rc) {
+		dev_err(&hdev->dev, "hid parse failed (%d)\n", rc);
+		return rc;
+	}
+
+	iio_dev = devm_iio_device_alloc(&hdev->dev, sizeof(*als_dev));
+	if (!iio_dev)
+		return -ENOMEM;
+
+	als_dev = iio_priv(iio_dev);
+	als_dev->hid_dev = hdev;
+	als_dev->iio_dev = iio_dev;
+	spin_lock_init(&als_dev->lock);
+	als_dev->thresh_rising = INT_MAX;
+
+	als_dev->illum_field =
+		appleals_find_hid_field(hdev, HID_USAGE_SENSOR_ALS,
+					HID_USAGE_SENSOR_LIGHT_ILLUM);
+	als_dev->report_state_field =
+		appleals_find_hid_field(hdev, HID_USAGE_SENSOR_ALS,
+					HID_USAGE_SENSOR_PROP_REPORT_STATE);
+	als_dev->power_state_field =
+		appleals_find_hid_field(hdev, HID_USAGE_SENSOR_ALS,
+					HID_USAGE_SENSOR_PROY_POWER_STATE);
+	als_dev->report_interval_field =
+		appleals_find_hid_field(hdev, HID_USAGE_SENSOR_ALS,
+					HID_USAGE_SENSOR_PROP_REPORT_INTERVAL);
+
+	if (!als_dev->illum_field || !als_dev->report_state_field ||
+	    !als_dev->power_state_field || !als_dev->report_interval_field) {
+		dev_err(&hdev->dev, "Failed to find ALS fields in %s\n",
+			dev_name(&hdev->dev));
+		return -ENODEV;
+	}
+
+	hid_set_drvdata(hdev, als_dev);
+
+	rc = hid_hw_start(hdev, HID_CONNECT_DRIVER);
+	if (rc) {
+		dev_err(&hdev->dev, "hw start failed (%d)\n", rc);
+		return rc;
+	}
+
+	rc = hid_hw_open(hdev);
+	if (rc) {
+		dev_err(&hdev->dev, "hw open failed (%d)\n", rc);
+		goto stop_hw;
+	}
+
+	rc = appleals_init_sensor(als_dev);
+	if (rc)
+		goto close_hw;
+
+	rc = appleals_config_iio(als_dev);
+	if (rc)
+		goto power_off;
+
+	rc = iio_device_register(iio_dev);
+	if (rc) {
+		dev_err(&hdev->dev, "Failed to register iio device (%d)\n",
+			rc);
+		goto power_off;
+	}
+
+	return 0;
+
+power_off:
+	appleals_set_power(als_dev, false);
+close_hw:
+	hid_hw_close(hdev);
+stop_hw:
+	hid_hw_stop(hdev);
+	return rc;
+}
+
+static void appleals_remove(struct hid_device *hdev)
+{
+	struct appleals_device *als_dev = hid_get_drvdata(hdev);
+
+	iio_device_unregister(als_dev->iio_dev);
+
+	appleals_set_reporting(als_dev, false);
+	appleals_set_power(als_dev, false);
+
+	hid_hw_close(hdev);
+	hid_hw_stop(hdev);
+}
+
+static const struct hid_device_id appleals_hid_ids[] = {
+	{ HID_USB_DEVICE(USB_VENDOR_ID_LINUX_FOUNDATION,
+			 USB_DEVICE_ID_IBRIDGE_ALS) },
+	{ },
+};
+
+MODULE_DEVICE_TABLE(hid, appleals_hid_ids);
+
+static struct hid_driver appleals_hid_driver = {
+	.name = "apple-ib-als",
+	.id_table = appleals_hid_ids,
+	.probe = appleals_probe,
+	.remove = appleals_remove,
+	.event = appleals_hid_event,
+};
+
+module_hid_driver(appleals_hid_driver);
+
+MODULE_AUTHOR("Ronald Tschalär");
+MODULE_DESCRIPTION("Apple iBridge ALS driver");
+MODULE_LICENSE("GPL");
@@ -42,13 +42,26 @@
 
 #include <linux/platform_device.h>
 #include <linux/acpi.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/hashtable.h>
 #include <linux/hid.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
 #include <linux/usb.h>
 #include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "hid-ids.h"
 #ifdef UPSTREAM
@@ -60,6 +73,53 @@
 #include "apple-ibridge.h"
 
 #define APPLEIB_BASIC_CONFIG	1
+#define APPLEIB_OSX_CONFIG	2
+
+#define APPLEIB_USAGE_HASH_BITS	4
+
+#define APPLEIB_MAX_FIELD_SIZE	32
+#define APPLEIB_MAX_PUSH_DEPTH	8
+#define APPLEIB_MAX_ITEM_SIZE	5
+
+#define APPLEIB_REQ_WAIT_TIMEOUT	(10 * HZ)
+#define APPLEIB_VENDOR_REQ_TIMEOUT	2000	/* ms */
+
+/* max reports queued for a child whose reports are delivered deferred */
+#define APPLEIB_RPT_QUEUE_MAX	64
+
+/* touch bar requests granted in a row before a waiting lower one goes */
+#define APPLEIB_CTRL_TB_BURST	8
+
+/*
+ * Priorities for access to the control endpoint; lower values are served
+ * first. URGENT is for APPLEIB_REQ_VENDOR_SET_REPORT, i.e. the touch bar
+ * mode switch on Fn on the T1, which must never wait behind ALS polls.
+ */
+enum appleib_ctrl_prio {
+	APPLEIB_PRIO_URGENT,
+	APPLEIB_PRIO_TB,
+	APPLEIB_PRIO_OTHER,
+	APPLEIB_PRIO_COUNT,
+};
+
+static char *appleib_extra_usages;
+module_param_named(extra_usages, appleib_extra_usages, charp, 0444);
+MODULE_PARM_DESC(extra_usages, "Additional collections to forward to virtual HID devices:\n"
+			       "    comma separated list of <usage>:<vendor>:<product> (all hex), e.g. ff120002:1d6b:0301.\n"
+			       "    entries given here take precedence over the built-in ones");
+
+static bool appleib_digitizer;
+module_param_named(digitizer, appleib_digitizer, bool, 0444);
+MODULE_PARM_DESC(digitizer, "Select the iBridge configuration that reports raw touches:\n"
+			    "    [N] - basic configuration, touch bar reports key presses\n"
+			    "    Y - OS X configuration, touch bar reports digitizer contacts");
+
+static bool appleib_defer_reports = true;
+module_param_named(defer_reports, appleib_defer_reports, bool, 0444);
+MODULE_PARM_DESC(defer_reports, "Where input reports for the virtual devices are processed:\n"
+				"    [Y] - touch bar reports in interrupt context, all others (ALS, vendor collections)\n"
+				"          batched to a workqueue\n"
+				"    N - all in interrupt context");
 
 static struct hid_device_id appleib_sub_hid_ids[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_LINUX_FOUNDATION,
@@ -68,10 +128,16 @@ static struct hid_device_id appleib_sub_hid_ids[] = {
 			 USB_DEVICE_ID_IBRIDGE_ALS) },
 };
 
-static struct {
-	unsigned int usage;
-	struct hid_device_id *dev_id;
-} appleib_usage_map[] = {
+struct appleib_usage_entry {
+	unsigned int		usage;
+	struct hid_device_id	*dev_id;
+	struct hlist_node	node;
+	/* only used for entries from the extra_usages parameter */
+	struct hid_device_id	extra_id;
+	struct list_head	extra_list;
+};
+
+static struct appleib_usage_entry appleib_usage_map[] = {
 	/* Default iBridge configuration, key inputs and mode settings */
 	{ 0x00010006, &appleib_sub_hid_ids[0] },
 	/* OS X iBridge configuration, digitizer inputs */
@@ -82,31 +148,506 @@ static struct {
 	{ 0x00200041, &appleib_sub_hid_ids[1] },
 };
 
+/*
+ * Usage to virtual device id mapping, built from appleib_usage_map[] and the
+ * extra_usages parameter before the hid driver is registered, and only torn
+ * down after it has been unregistered; hence no locking is needed.
+ */
+static DEFINE_HASHTABLE(appleib_usage_hash, APPLEIB_USAGE_HASH_BITS);
+static LIST_HEAD(appleib_extra_usage_list);
+
 struct appleib_device {
 	acpi_handle asoc_socw;
 };
 
+static struct dentry *appleib_debugfs_root;
+
+struct appleib_hid_dev_info;
+
+/**
+ * struct appleib_ctrl_arb - Arbitrates the control endpoint of a real device
+ * between its virtual children.
+ * @lock:    protects the other fields
+ * @busy:    whether a request is currently in flight
+ * @tb_grants: touch bar requests granted since the last lower priority one
+ *             while the latter were waiting
+ * @waiters: per-priority FIFOs of struct appleib_ctrl_waiter
+ * @wait:    where waiters sleep until granted
+ *
+ * Requests are served by priority, and in arrival order within a priority.
+ * So that sustained touch bar traffic can't starve the other children, a
+ * waiting lower priority request is let through after every
+ * APPLEIB_CTRL_TB_BURST touch bar ones; urgent requests always go first.
+ */
+struct appleib_ctrl_arb {
+	spinlock_t		lock;
+	bool			busy;
+	unsigned int		tb_grants;
+	struct list_head	waiters[APPLEIB_PRIO_COUNT];
+	wait_queue_head_t	wait;
+};
+
+struct appleib_ctrl_waiter {
+	struct list_head	list;
+	bool			granted;
+};
+
+/* A hid_hw_request() queued for asynchronous execution */
+struct appleib_async_req {
+	struct list_head	list;
+	struct hid_report	*report;
+	int			reqtype;
+	u8			*buf;
+};
+
+/* An input report queued for deferred delivery */
+struct appleib_queued_rpt {
+	struct list_head	list;
+	unsigned int		type;
+	int			size;
+	u8			data[];
+};
+
+/**
+ * struct appleib_sub_stats - Forwarding statistics of one virtual child,
+ * exported via debugfs.
+ */
+struct appleib_sub_stats {
+	atomic64_t	reports_fwd;
+	atomic64_t	reports_dropped;	/* child not open */
+	atomic64_t	bytes_fwd;
+	atomic64_t	input_errors;		/* hid_input_report() failed */
+	atomic64_t	reports_deferred;
+	atomic64_t	reports_overrun;	/* deferred queue full */
+	atomic64_t	raw_requests;
+	atomic64_t	raw_request_ns;
+	atomic64_t	raw_request_max_ns;
+	atomic64_t	output_reports;
+	atomic64_t	output_report_ns;
+	atomic64_t	output_report_max_ns;
+	atomic64_t	power_fullon;
+	atomic64_t	power_normal;
+};
+
+/**
+ * struct appleib_sub_dev - State of one virtual child HID device.
+ * @hdev_info: the real HID device this child forwards to
+ * @sub_hdev:  the virtual child HID device; its driver_data points back here
+ * @open:      whether the child's driver currently has the device open
+ * @list:      entry in &appleib_hid_dev_info.sub_devs
+ * @dev_id:    the id to create the child with
+ * @add_work:  creates the child asynchronously during probe
+ * @add_rc:    result of @add_work
+ * @prio:      the child's priority on the control endpoint
+ * @req_lock:  protects @reqs and @reqs_pending
+ * @reqs:      queued struct appleib_async_req's
+ * @reqs_pending: number of queued and in-flight asynchronous requests
+ * @req_work:  executes the queued requests
+ * @req_wait:  for appleib_ll_wait() to wait on @reqs_pending
+ * @power_level: the last level passed to appleib_ll_power()
+ * @defer:     whether input reports are delivered from @rpt_work rather than
+ *             directly from appleib_hid_raw_event()
+ * @rpt_lock:  protects @rpts and @rpts_queued
+ * @rpts:      queued struct appleib_queued_rpt's
+ * @rpts_queued: number of entries on @rpts
+ * @rpt_work:  delivers the queued reports
+ * @stats:     forwarding statistics
+ * @debugfs_dir: the child's debugfs directory
+ */
+struct appleib_sub_dev {
+	struct appleib_hid_dev_info	*hdev_info;
+	struct hid_device		*sub_hdev;
+	bool				open;
+	struct list_head		list;
+	struct hid_device_id		*dev_id;
+	struct work_struct		add_work;
+	int				add_rc;
+	enum appleib_ctrl_prio		prio;
+	spinlock_t			req_lock;
+	struct list_head		reqs;
+	unsigned int			reqs_pending;
+	struct work_struct		req_work;
+	wait_queue_head_t		req_wait;
+	int				power_level;
+	bool				defer;
+	spinlock_t			rpt_lock;
+	struct list_head		rpts;
+	unsigned int			rpts_queued;
+	struct work_struct		rpt_work;
+	struct appleib_sub_stats	stats;
+	struct dentry			*debugfs_dir;
+};
+
 struct appleib_hid_dev_info {
 	struct hid_device	*hdev;
-	struct hid_device	*sub_hdevs[ARRAY_SIZE(appleib_sub_hid_ids)];
-	bool			sub_open[ARRAY_SIZE(appleib_sub_hid_ids)];
+	/* RCU protected list of struct appleib_sub_dev */
+	struct list_head	sub_devs;
+	/* serializes updates to sub_devs */
+	struct mutex		sub_devs_lock;
+	struct appleib_ctrl_arb	ctrl_arb;
+	/* one slot per collection in hdev, indexed by collection index */
+	struct appleib_sub_dev	sub_dev_slots[];
 };
 
+static void appleib_deliver_report(struct appleib_sub_dev *sub_dev,
+				   unsigned int type, u8 *data,
+				   int size)
+{
+	int rc;
+
+	rc = hid_input_report(sub_dev->sub_hdev, type, data, size, 0);
+
+	atomic64_inc(&sub_dev->stats.reports_fwd);
+	atomic64_add(size, &sub_dev->stats.bytes_fwd);
+	if (rc)
+		atomic64_inc(&sub_dev->stats.input_errors);
+}
+
+/* Called in atomic context: copy the report for appleib_rpt_worker(). */
+static void appleib_queue_report(struct appleib_sub_dev *sub_dev,
+				 unsigned int type, u8 *data,
+				 int size)
+{
+	struct appleib_queued_rpt *rpt;
+	unsigned long flags;
+
+	if (READ_ONCE(sub_dev->rpts_queued) >= APPLEIB_RPT_QUEUE_MAX) {
+		atomic64_inc(&sub_dev->stats.reports_overrun);
+		return;
+	}
+
+	rpt = kmalloc(struct_size(rpt, data, size), GFP_ATOMIC);
+	if (!rpt) {
+		atomic64_inc(&sub_dev->stats.reports_overrun);
+		return;
+	}
+
+	rpt->type = type;
+	rpt->size = size;
+	memcpy(rpt->data, data, size);
+
+	spin_lock_irqsave(&sub_dev->rpt_lock, flags);
+	list_add_tail(&rpt->list, &sub_dev->rpts);
+	sub_dev->rpts_queued++;
+	spin_unlock_irqrestore(&sub_dev->rpt_lock, flags);
+
+	atomic64_inc(&sub_dev->stats.reports_deferred);
+
+	queue_work(system_unbound_wq, &sub_dev->rpt_work);
+}
+
+/*
+ * Deliver all reports queued for a child in one go, so that a burst of
+ * sensor reports costs a single work item.
+ */
+static void appleib_rpt_worker(struct work_struct *work)
+{
+	struct appleib_sub_dev *sub_dev =
+		container_of(work, struct appleib_sub_dev, rpt_work);
+	struct appleib_queued_rpt *rpt, *tmp;
+	unsigned long flags;
+	LIST_HEAD(rpts);
+
+	spin_lock_irqsave(&sub_dev->rpt_lock, flags);
+	list_splice_init(&sub_dev->rpts, &rpts);
+	sub_dev->rpts_queued = 0;
+	spin_unlock_irqrestore(&sub_dev->rpt_lock, flags);
+
+	list_for_each_entry_safe(rpt, tmp, &rpts, list) {
+		list_del(&rpt->list);
+
+		if (READ_ONCE(sub_dev->open))
+			appleib_deliver_report(sub_dev, rpt->type, rpt->data,
+					       rpt->size);
+		else
+			atomic64_inc(&sub_dev->stats.reports_dropped);
+
+		kfree(rpt);
+	}
+}
+
+static void appleib_free_rpts(struct appleib_sub_dev *sub_dev)
+{
+	struct appleib_queued_rpt *rpt, *tmp;
+
+	list_for_each_entry_safe(rpt, tmp, &sub_dev->rpts, list) {
+		list_del(&rpt->list);
+		kfree(rpt);
+	}
+
+	sub_dev->rpts_queued = 0;
+}
+
+/*
+ * Touch bar reports are processed right here, in the URB completion, so that
+ * key latency doesn't depend on the other children's traffic; reports for
+ * other children are handed off to a workqueue unless defer_reports is off.
+ */
 static int appleib_hid_raw_event(struct hid_device *hdev,
 				 struct hid_report *report, u8 *data, int size)
 {
 	struct appleib_hid_dev_info *hdev_info = hid_get_drvdata(hdev);
-	int i;
+	struct appleib_sub_dev *sub_dev;
+
+	rcu_read_lock();
 
-	for (i = 0; i < ARRAY_SIZE(hdev_info->sub_hdevs); i++) {
-		if (READ_ONCE(hdev_info->sub_open[i]))
-			hid_input_report(hdev_info->sub_hdevs[i], report->type,
-					 data, size, 0);
+	list_for_each_entry_rcu(sub_dev, &hdev_info->sub_devs, list) {
+		if (!READ_ONCE(sub_dev->open)) {
+			atomic64_inc(&sub_dev->stats.reports_dropped);
+			continue;
+		}
+
+		if (sub_dev->defer)
+			appleib_queue_report(sub_dev, report->type, data,
+					     size);
+		else
+			appleib_deliver_report(sub_dev, report->type, data,
+					       size);
 	}
 
+	rcu_read_unlock();
+
 	return 0;
 }
 
+/*
+ * Rewritten report descriptors, keyed by a hash of the original descriptor,
+ * so that re-probes (e.g. after a configuration change or resume) don't need
+ * to redo the rewrite. Entries live until the module is unloaded.
+ */
+struct appleib_rdesc_cache_entry {
+	struct list_head	list;
+	u32			hash;
+	u8			*fixed;		/* NULL if no rewrite needed */
+	unsigned int		fixed_size;
+	unsigned int		orig_size;
+	u8			orig[];
+};
+
+static LIST_HEAD(appleib_rdesc_cache);
+static DEFINE_MUTEX(appleib_rdesc_cache_lock);
+
+/**
+ * appleib_put_item() - Emit a short global item with the smallest encoding.
+ * @buf: where to write the item, or NULL to only compute its length
+ * @tag: the global item tag
+ * @value: the item's (unsigned) data
+ *
+ * Returns: the number of bytes (to be) written.
+ */
+static unsigned int appleib_put_item(u8 *buf, u8 tag, u32 value)
+{
+	unsigned int dlen = value > 0xffff ? 4 : value > 0xff ? 2 : 1;
+	unsigned int i;
+
+	if (buf) {
+		buf[0] = (tag << 4) | (HID_ITEM_TYPE_GLOBAL << 2) |
+			 (dlen == 4 ? 3 : dlen);
+		for (i = 0; i < dlen; i++)
+			buf[1 + i] = value >> (8 * i);
+	}
+
+	return 1 + dlen;
+}
+
+/**
+ * appleib_split_wide_fields() - Rewrite a report descriptor so that no field
+ * is wider than 32 bits.
+ * @rdesc: the original report descriptor
+ * @rsize: the size of @rdesc
+ * @out: buffer for the rewritten descriptor, or NULL to only compute its size
+ * @out_size: set to the size of the rewritten descriptor
+ *
+ * Fields of more than 32 bits are not valid according to HID 1.11 Section
+ * 8.4 ("An item field cannot span more than 4 bytes in a report"), and
+ * hid_field_extract() complains about them. So every Input, Output, or
+ * Feature item whose current Report Size exceeds 32 bits is surrounded by
+ * Report Size and Report Count items that describe the same bits as
+ * several equally sized fields of at most 32 bits each, followed by items
+ * restoring the original global state for subsequent main items.
+ *
+ * Returns: the number of main items split, or a negative error code if the
+ * descriptor could not be parsed.
+ */
+static int appleib_split_wide_fields(const u8 *rdesc, unsigned int rsize,
+				     u8 *out, unsigned int *out_size)
+{
+	u32 size_stack[APPLEIB_MAX_PUSH_DEPTH];
+	u32 count_stack[APPLEIB_MAX_PUSH_DEPTH];
+	u32 report_size = 0, report_count = 0;
+	unsigned int pos = 0, opos = 0, depth = 0;
+	unsigned int len, dlen, i;
+	int nsplit = 0;
+	u8 type, tag;
+	u32 data, n, count;
+
+	while (pos < rsize) {
+		/* long items (prefix 0xfe) are copied verbatim */
+		if (rdesc[pos] == 0xfe) {
+			if (pos + 1 >= rsize)
+				return -EINVAL;
+			len = 3 + rdesc[pos + 1];
+			if (pos + len > rsize)
+				return -EINVAL;
+
+			if (out)
+				memcpy(out + opos, rdesc + pos, len);
+			pos += len;
+			opos += len;
+			continue;
+		}
+
+		dlen = rdesc[pos] & 0x03;
+		if (dlen == 3)
+			dlen = 4;
+		len = 1 + dlen;
+		if (pos + len > rsize)
+			return -EINVAL;
+
+		type = (rdesc[pos] >> 2) & 0x03;
+		tag = rdesc[pos] >> 4;
+		data = 0;
+		for (i = 0; i < dlen; i++)
+			data |= (u32)rdesc[pos + 1 + i] << (8 * i);
+
+		if (type == HID_ITEM_TYPE_GLOBAL) {
+			switch (tag) {
+			case HID_GLOBAL_ITEM_TAG_REPORT_SIZE:
+				report_size = data;
+				break;
+			case HID_GLOBAL_ITEM_TAG_REPORT_COUNT:
+				report_count = data;
+				break;
+			case HID_GLOBAL_ITEM_TAG_PUSH:
+				if (depth >= APPLEIB_MAX_PUSH_DEPTH)
+					return -E2BIG;
+				size_stack[depth] = report_size;
+				count_stack[depth] = report_count;
+				depth++;
+				break;
+			case HID_GLOBAL_ITEM_TAG_POP:
+				if (!depth)
+					return -EINVAL;
+				depth--;
+				report_size = size_stack[depth];
+				report_count = count_stack[depth];
+				break;
+			}
+		}
+
+		if (type == HID_ITEM_TYPE_MAIN &&
+		    (tag == HID_MAIN_ITEM_TAG_INPUT ||
+		     tag == HID_MAIN_ITEM_TAG_OUTPUT ||
+		     tag == HID_MAIN_ITEM_TAG_FEATURE) &&
+		    report_size > APPLEIB_MAX_FIELD_SIZE) {
+			/* smallest number of equally sized fields that fit */
+			n = DIV_ROUND_UP(report_size, APPLEIB_MAX_FIELD_SIZE);
+			while (report_size % n)
+				n++;
+			if (check_mul_overflow(report_count, n, &count))
+				return -EOVERFLOW;
+
+			opos += appleib_put_item(out ? out + opos : NULL,
+						 HID_GLOBAL_ITEM_TAG_REPORT_SIZE,
+						 report_size / n);
+			opos += appleib_put_item(out ? out + opos : NULL,
+						 HID_GLOBAL_ITEM_TAG_REPORT_COUNT,
+						 count);
+			if (out)
+				memcpy(out + opos, rdesc + pos, len);
+			opos += len;
+			opos += appleib_put_item(out ? out + opos : NULL,
+						 HID_GLOBAL_ITEM_TAG_REPORT_SIZE,
+						 report_size);
+			opos += appleib_put_item(out ? out + opos : NULL,
+						 HID_GLOBAL_ITEM_TAG_REPORT_COUNT,
+						 report_count);
+			nsplit++;
+		} else {
+			if (out)
+				memcpy(out + opos, rdesc + pos, len);
+			opos += len;
+		}
+
+		pos += len;
+	}
+
+	*out_size = opos;
+
+	return nsplit;
+}
+
+static struct appleib_rdesc_cache_entry *
+appleib_find_cached_rdesc(const u8 *rdesc, unsigned int rsize, u32 hash)
+{
+	struct appleib_rdesc_cache_entry *entry;
+
+	list_for_each_entry(entry, &appleib_rdesc_cache, list) {
+		if (entry->hash == hash && entry->orig_size == rsize &&
+		    !memcmp(entry->orig, rdesc, rsize))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static struct appleib_rdesc_cache_entry *
+appleib_create_cached_rdesc(struct hid_device *hdev, const u8 *rdesc,
+			    unsigned int rsize, u32 hash)
+{
+	struct appleib_rdesc_cache_entry *entry;
+	unsigned int new_size;
+	int nsplit;
+
+	nsplit = appleib_split_wide_fields(rdesc, rsize, NULL, &new_size);
+	if (nsplit < 0) {
+		hid_warn(hdev, "Failed to parse report descriptor (%d)\n",
+			 nsplit);
+		return NULL;
+	}
+
+	entry = kzalloc(struct_size(entry, orig, rsize), GFP_KERNEL);
+	if (!entry)
+		return NULL;
+
+	entry->hash = hash;
+	entry->orig_size = rsize;
+	memcpy(entry->orig, rdesc, rsize);
+
+	if (nsplit > 0) {
+		entry->fixed = kmalloc(new_size, GFP_KERNEL);
+		if (!entry->fixed) {
+			kfree(entry);
+			return NULL;
+		}
+
+		appleib_split_wide_fields(rdesc, rsize, entry->fixed,
+					  &entry->fixed_size);
+
+		hid_dbg(hdev, "Split %d fields wider than %d bits\n", nsplit,
+			APPLEIB_MAX_FIELD_SIZE);
+	}
+
+	list_add(&entry->list, &appleib_rdesc_cache);
+
+	return entry;
+}
+
+static void appleib_free_rdesc_cache(void)
+{
+	struct appleib_rdesc_cache_entry *entry, *tmp;
+
+	mutex_lock(&appleib_rdesc_cache_lock);
+
+	list_for_each_entry_safe(entry, tmp, &appleib_rdesc_cache, list) {
+		list_del(&entry->list);
+		kfree(entry->fixed);
+		kfree(entry);
+	}
+
+	mutex_unlock(&appleib_rdesc_cache_lock);
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6,12,0)
 static __u8 *appleib_report_fixup(struct hid_device *hdev, __u8 *rdesc,
 				  unsigned int *rsize)
@@ -115,42 +656,30 @@ static const __u8 *appleib_report_fixup(struct hid_device *hdev, __u8 *rdesc,
 				  unsigned int *rsize)
 #endif
 {
-	/* Some fields have a size of 64 bits, which according to HID 1.11
-	 * Section 8.4 is not valid ("An item field cannot span more than 4
-	 * bytes in a report"). Furthermore, hid_field_extract() complains
-	 * when encountering such a field. So turn them into two 32-bit fields
-	 * instead.
+	struct appleib_rdesc_cache_entry *entry;
+	u32 hash;
+
+	/* Some fields have a size of 64 bits; see appleib_split_wide_fields() */
+
+	hash = jhash(rdesc, *rsize, 0);
+
+	mutex_lock(&appleib_rdesc_cache_lock);
+
+	entry = appleib_find_cached_rdesc(rdesc, *rsize, hash);
+	if (!entry)
+		entry = appleib_create_cached_rdesc(hdev, rdesc, *rsize, hash);
+
+	mutex_unlock(&appleib_rdesc_cache_lock);
+
+	/*
+	 * hid-core copies the returned descriptor, and cache entries are only
+	 * freed after the hid driver has been unregistered.
 	 */
+	if (!entry || !entry->fixed)
+		return rdesc;
 
-	if (*rsize == 634 &&
-	    /* Usage Page 0xff12 (vendor defined) */
-	    rdesc[212] == 0x06 && rdesc[213] == 0x12 && rdesc[214] == 0xff &&
-	    /* Usage 0x51 */
-	    rdesc[416] == 0x09 && rdesc[417] == 0x51 &&
-	    /* report size 64 */
-	    rdesc[432] == 0x75 && rdesc[433] == 64 &&
-	    /* report count 1 */
-	    rdesc[434] == 0x95 && rdesc[435] == 1) {
-		rdesc[433] = 32;
-		rdesc[435] = 2;
-		hid_dbg(hdev, "Fixed up first 64-bit field\n");
-	}
-
-	if (*rsize == 634 &&
-	    /* Usage Page 0xff12 (vendor defined) */
-	    rdesc[212] == 0x06 && rdesc[213] == 0x12 && rdesc[214] == 0xff &&
-	    /* Usage 0x51 */
-	    rdesc[611] == 0x09 && rdesc[612] == 0x51 &&
-	    /* report size 64 */
-	    rdesc[627] == 0x75 && rdesc[628] == 64 &&
-	    /* report count 1 */
-	    rdesc[629] == 0x95 && rdesc[630] == 1) {
-		rdesc[628] = 32;
-		rdesc[630] = 2;
-		hid_dbg(hdev, "Fixed up second 64-bit field\n");
-	}
-
-	return rdesc;
+	*rsize = entry->fixed_size;
+	return entry->fixed;
 }
 
 #ifdef CONFIG_PM
@@ -171,20 +700,24 @@ static int appleib_forward_int_op(struct hid_device *hdev,
 				  void *args)
 {
 	struct appleib_hid_dev_info *hdev_info = hid_get_drvdata(hdev);
+	struct appleib_sub_dev *sub_dev;
 	struct hid_device *sub_hdev;
-	int rc;
-	int i;
+	int rc = 0;
+
+	mutex_lock(&hdev_info->sub_devs_lock);
 
-	for (i = 0; i < ARRAY_SIZE(hdev_info->sub_hdevs); i++) {
-		sub_hdev = hdev_info->sub_hdevs[i];
+	list_for_each_entry(sub_dev, &hdev_info->sub_devs, list) {
+		sub_hdev = sub_dev->sub_hdev;
 		if (sub_hdev->driver) {
 			rc = forward(sub_hdev->driver, sub_hdev, args);
 			if (rc)
-				return rc;
+				break;
 		}
 	}
 
-	return 0;
+	mutex_unlock(&hdev_info->sub_devs_lock);
+
+	return rc;
 }
 
 static int appleib_hid_suspend_fwd(struct hid_driver *drv,
@@ -243,30 +776,25 @@ static int appleib_ll_start(struct hid_device *hdev)
 
 static void appleib_ll_stop(struct hid_device *hdev)
 {
+	struct appleib_sub_dev *sub_dev = hdev->driver_data;
+
+	/* complete any asynchronous requests the driver issued */
+	flush_work(&sub_dev->req_work);
 }
 
 static int appleib_set_open(struct hid_device *hdev, bool open)
 {
-	struct appleib_hid_dev_info *hdev_info = hdev->driver_data;
-	int i;
+	struct appleib_sub_dev *sub_dev = hdev->driver_data;
 
-	for (i = 0; i < ARRAY_SIZE(hdev_info->sub_hdevs); i++) {
-		/*
-		 * hid_hw_open(), and hence appleib_ll_open(), is called
-		 * from the driver's probe function, which in turn is called
-		 * while adding the sub-hdev; but at this point we haven't yet
-		 * added the sub-hdev to our list. So if we don't find the
-		 * sub-hdev in our list assume it's in the process of being
-		 * added and set the flag on the first unset sub-hdev.
-		 */
-		if (hdev_info->sub_hdevs[i] == hdev ||
-		    !hdev_info->sub_hdevs[i]) {
-			WRITE_ONCE(hdev_info->sub_open[i], open);
-			return 0;
-		}
-	}
+	/*
+	 * hid_hw_open(), and hence appleib_ll_open(), is called from the
+	 * driver's probe function, i.e. possibly before the sub-device has
+	 * been published on the sub_devs list. This is fine since the
+	 * driver_data is set up before the sub-device is added.
+	 */
+	WRITE_ONCE(sub_dev->open, open);
 
-	return -ENODEV;
+	return 0;
 }
 
 static int appleib_ll_open(struct hid_device *hdev)
@@ -281,9 +809,16 @@ static void appleib_ll_close(struct hid_device *hdev)
 
 static int appleib_ll_power(struct hid_device *hdev, int level)
 {
-	struct appleib_hid_dev_info *hdev_info = hdev->driver_data;
+	struct appleib_sub_dev *sub_dev = hdev->driver_data;
+
+	if (xchg(&sub_dev->power_level, level) != level) {
+		if (level == PM_HINT_FULLON)
+			atomic64_inc(&sub_dev->stats.power_fullon);
+		else if (level == PM_HINT_NORMAL)
+			atomic64_inc(&sub_dev->stats.power_normal);
+	}
 
-	return hid_hw_power(hdev_info->hdev, level);
+	return hid_hw_power(sub_dev->hdev_info->hdev, level);
 }
 
 static int appleib_ll_parse(struct hid_device *hdev)
@@ -292,38 +827,308 @@ static int appleib_ll_parse(struct hid_device *hdev)
 	return 0;
 }
 
-static void appleib_ll_request(struct hid_device *hdev,
-			       struct hid_report *report, int reqtype)
+static void appleib_ctrl_arb_init(struct appleib_ctrl_arb *arb)
 {
-	struct appleib_hid_dev_info *hdev_info = hdev->driver_data;
+	int prio;
 
-	hid_hw_request(hdev_info->hdev, report, reqtype);
+	spin_lock_init(&arb->lock);
+	for (prio = 0; prio < APPLEIB_PRIO_COUNT; prio++)
+		INIT_LIST_HEAD(&arb->waiters[prio]);
+	init_waitqueue_head(&arb->wait);
 }
 
-static int appleib_ll_wait(struct hid_device *hdev)
+/**
+ * appleib_ctrl_acquire() - Wait for exclusive use of the real device's
+ * control endpoint.
+ * @arb:  the real device's arbiter
+ * @prio: the priority of the request
+ */
+static void appleib_ctrl_acquire(struct appleib_ctrl_arb *arb,
+				 enum appleib_ctrl_prio prio)
 {
-	struct appleib_hid_dev_info *hdev_info = hdev->driver_data;
+	struct appleib_ctrl_waiter waiter = { .granted = false };
+	unsigned long flags;
 
-	hid_hw_wait(hdev_info->hdev);
-	return 0;
+	spin_lock_irqsave(&arb->lock, flags);
+
+	if (!arb->busy) {
+		arb->busy = true;
+		spin_unlock_irqrestore(&arb->lock, flags);
+		return;
+	}
+
+	list_add_tail(&waiter.list, &arb->waiters[prio]);
+
+	spin_unlock_irqrestore(&arb->lock, flags);
+
+	wait_event(arb->wait, smp_load_acquire(&waiter.granted));
+}
+
+/* must be called with the arbiter's lock held */
+static struct appleib_ctrl_waiter *
+appleib_ctrl_next_waiter(struct appleib_ctrl_arb *arb)
+{
+	bool others_waiting = !list_empty(&arb->waiters[APPLEIB_PRIO_OTHER]);
+	struct appleib_ctrl_waiter *waiter;
+	int prio;
+
+	for (prio = 0; prio < APPLEIB_PRIO_COUNT; prio++) {
+		if (prio == APPLEIB_PRIO_TB && others_waiting &&
+		    arb->tb_grants >= APPLEIB_CTRL_TB_BURST)
+			continue;
+
+		waiter = list_first_entry_or_null(&arb->waiters[prio],
+						  struct appleib_ctrl_waiter,
+						  list);
+		if (!waiter)
+			continue;
+
+		if (prio == APPLEIB_PRIO_TB && others_waiting)
+			arb->tb_grants++;
+		else if (prio != APPLEIB_PRIO_URGENT)
+			arb->tb_grants = 0;
+
+		return waiter;
+	}
+
+	return NULL;
+}
+
+/**
+ * appleib_ctrl_release() - Hand the control endpoint to the next waiter.
+ * @arb: the real device's arbiter
+ */
+static void appleib_ctrl_release(struct appleib_ctrl_arb *arb)
+{
+	struct appleib_ctrl_waiter *waiter;
+	unsigned long flags;
+
+	spin_lock_irqsave(&arb->lock, flags);
+
+	waiter = appleib_ctrl_next_waiter(arb);
+	if (waiter) {
+		/* busy stays set: ownership passes directly to the waiter */
+		list_del(&waiter->list);
+		smp_store_release(&waiter->granted, true);
+	} else {
+		arb->busy = false;
+	}
+
+	spin_unlock_irqrestore(&arb->lock, flags);
+
+	if (waiter)
+		wake_up_all(&arb->wait);
+}
+
+static void appleib_account_latency(atomic64_t *count, atomic64_t *total_ns,
+				    atomic64_t *max_ns, ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	s64 old = atomic64_read(max_ns);
+
+	atomic64_inc(count);
+	atomic64_add(ns, total_ns);
+
+	while (ns > old) {
+		s64 cur = atomic64_cmpxchg(max_ns, old, ns);
+
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+/*
+ * On the T1 the touch bar mode is set with a vendor request, without a
+ * leading report-id in the data, which usbhid can't send.
+ */
+static int appleib_vendor_set_report(struct hid_device *hdev,
+				     unsigned char reportnum, __u8 *buf,
+				     size_t len, unsigned char rtype)
+{
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct usb_device *udev = interface_to_usbdev(intf);
+
+	return usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
+			       HID_REQ_SET_REPORT,
+			       USB_DIR_OUT | USB_RECIP_INTERFACE |
+			       USB_TYPE_VENDOR,
+			       (rtype + 1) << 8 | reportnum,
+			       intf->cur_altsetting->desc.bInterfaceNumber,
+			       buf, len, APPLEIB_VENDOR_REQ_TIMEOUT);
 }
 
 static int appleib_ll_raw_request(struct hid_device *hdev,
 				  unsigned char reportnum, __u8 *buf,
 				  size_t len, unsigned char rtype, int reqtype)
 {
-	struct appleib_hid_dev_info *hdev_info = hdev->driver_data;
+	struct appleib_sub_dev *sub_dev = hdev->driver_data;
+	struct appleib_hid_dev_info *hdev_info = sub_dev->hdev_info;
+	ktime_t start = ktime_get();
+	int rc;
+
+	if (reqtype == APPLEIB_REQ_VENDOR_SET_REPORT) {
+		appleib_ctrl_acquire(&hdev_info->ctrl_arb, APPLEIB_PRIO_URGENT);
+		rc = appleib_vendor_set_report(hdev_info->hdev, reportnum, buf,
+					       len, rtype);
+	} else {
+		appleib_ctrl_acquire(&hdev_info->ctrl_arb, sub_dev->prio);
+		rc = hid_hw_raw_request(hdev_info->hdev, reportnum, buf, len,
+					rtype, reqtype);
+	}
+	appleib_ctrl_release(&hdev_info->ctrl_arb);
 
-	return hid_hw_raw_request(hdev_info->hdev, reportnum, buf, len, rtype,
-				  reqtype);
+	appleib_account_latency(&sub_dev->stats.raw_requests,
+				&sub_dev->stats.raw_request_ns,
+				&sub_dev->stats.raw_request_max_ns, start);
+
+	return rc;
 }
 
 static int appleib_ll_output_report(struct hid_device *hdev, __u8 *buf,
 				    size_t len)
 {
-	struct appleib_hid_dev_info *hdev_info = hdev->driver_data;
+	struct appleib_sub_dev *sub_dev = hdev->driver_data;
+	ktime_t start = ktime_get();
+	int rc;
+
+	appleib_ctrl_acquire(&sub_dev->hdev_info->ctrl_arb, sub_dev->prio);
+	rc = hid_hw_output_report(sub_dev->hdev_info->hdev, buf, len);
+	appleib_ctrl_release(&sub_dev->hdev_info->ctrl_arb);
+
+	appleib_account_latency(&sub_dev->stats.output_reports,
+				&sub_dev->stats.output_report_ns,
+				&sub_dev->stats.output_report_max_ns, start);
 
-	return hid_hw_output_report(hdev_info->hdev, buf, len);
+	return rc;
+}
+
+/*
+ * Asynchronous requests are not passed on to the real device's request
+ * queue, since that would let the children's requests contend there without
+ * priorities, and hid_hw_wait() would make each child wait for all of them.
+ * Instead they are queued per child and executed as raw requests from the
+ * child's own work item, so that they go through the arbitration above and
+ * appleib_ll_wait() only waits for the calling child's requests.
+ */
+static void appleib_ll_request(struct hid_device *hdev,
+			       struct hid_report *report, int reqtype)
+{
+	struct appleib_sub_dev *sub_dev = hdev->driver_data;
+	struct appleib_async_req *req;
+	unsigned long flags;
+
+	if (reqtype != HID_REQ_GET_REPORT && reqtype != HID_REQ_SET_REPORT)
+		return;
+
+	/* may be called in atomic context */
+	req = kzalloc(sizeof(*req), GFP_ATOMIC);
+	if (!req)
+		return;
+
+	req->buf = hid_alloc_report_buf(report, GFP_ATOMIC);
+	if (!req->buf) {
+		kfree(req);
+		return;
+	}
+
+	req->report = report;
+	req->reqtype = reqtype;
+
+	/* capture the field values now, like usbhid does */
+	if (reqtype == HID_REQ_SET_REPORT)
+		hid_output_report(report, req->buf);
+
+	spin_lock_irqsave(&sub_dev->req_lock, flags);
+	list_add_tail(&req->list, &sub_dev->reqs);
+	sub_dev->reqs_pending++;
+	spin_unlock_irqrestore(&sub_dev->req_lock, flags);
+
+	queue_work(system_unbound_wq, &sub_dev->req_work);
+}
+
+static void appleib_req_worker(struct work_struct *work)
+{
+	struct appleib_sub_dev *sub_dev =
+		container_of(work, struct appleib_sub_dev, req_work);
+	struct hid_device *sub_hdev = sub_dev->sub_hdev;
+	struct appleib_async_req *req;
+	struct hid_report *report;
+	unsigned long flags;
+	bool idle;
+	int rc;
+
+	while (true) {
+		spin_lock_irqsave(&sub_dev->req_lock, flags);
+		req = list_first_entry_or_null(&sub_dev->reqs,
+					       struct appleib_async_req, list);
+		if (req)
+			list_del(&req->list);
+		spin_unlock_irqrestore(&sub_dev->req_lock, flags);
+
+		if (!req)
+			break;
+
+		report = req->report;
+
+		rc = appleib_ll_raw_request(sub_hdev, report->id, req->buf,
+					    hid_report_len(report),
+					    report->type, req->reqtype);
+		if (rc < 0)
+			hid_dbg(sub_hdev, "ib: async request for report %u failed (%d)\n",
+				report->id, rc);
+		else if (req->reqtype == HID_REQ_GET_REPORT)
+			hid_input_report(sub_hdev, report->type, req->buf, rc,
+					 0);
+
+		kfree(req->buf);
+		kfree(req);
+
+		spin_lock_irqsave(&sub_dev->req_lock, flags);
+		idle = --sub_dev->reqs_pending == 0;
+		spin_unlock_irqrestore(&sub_dev->req_lock, flags);
+
+		if (idle)
+			wake_up_all(&sub_dev->req_wait);
+	}
+}
+
+static bool appleib_reqs_idle(struct appleib_sub_dev *sub_dev)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&sub_dev->req_lock, flags);
+	idle = sub_dev->reqs_pending == 0;
+	spin_unlock_irqrestore(&sub_dev->req_lock, flags);
+
+	return idle;
+}
+
+static int appleib_ll_wait(struct hid_device *hdev)
+{
+	struct appleib_sub_dev *sub_dev = hdev->driver_data;
+
+	if (!wait_event_timeout(sub_dev->req_wait, appleib_reqs_idle(sub_dev),
+				APPLEIB_REQ_WAIT_TIMEOUT)) {
+		hid_dbg(hdev, "ib: timeout waiting for requests\n");
+		return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+static void appleib_free_reqs(struct appleib_sub_dev *sub_dev)
+{
+	struct appleib_async_req *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, &sub_dev->reqs, list) {
+		list_del(&req->list);
+		kfree(req->buf);
+		kfree(req);
+	}
+
+	sub_dev->reqs_pending = 0;
 }
 
 static struct hid_ll_driver appleib_ll_driver = {
@@ -341,26 +1146,179 @@ static struct hid_ll_driver appleib_ll_driver = {
 
 static struct hid_device_id *appleib_find_dev_id_for_usage(unsigned int usage)
 {
-	int i;
+	struct appleib_usage_entry *entry;
 
-	for (i = 0; i < ARRAY_SIZE(appleib_usage_map); i++) {
-		if (appleib_usage_map[i].usage == usage)
-			return appleib_usage_map[i].dev_id;
+	hash_for_each_possible(appleib_usage_hash, entry, node, usage) {
+		if (entry->usage == usage)
+			return entry->dev_id;
 	}
 
 	return NULL;
 }
 
-static struct hid_device *
-appleib_add_sub_dev(struct appleib_hid_dev_info *hdev_info,
-		    struct hid_device_id *dev_id)
+/**
+ * appleib_parse_extra_usages() - Add the entries from the extra_usages
+ * module parameter to the usage hash.
+ * @dev: the device to log errors against
+ *
+ * Since hash_add() inserts at the head of the bucket, these entries take
+ * precedence over built-in ones for the same usage.
+ *
+ * Returns: 0 on success, or a negative error code.
+ */
+static int appleib_parse_extra_usages(struct device *dev)
 {
+	struct appleib_usage_entry *entry;
+	unsigned int usage, vendor, product;
+	char *params, *cur, *tok;
+
+	if (!appleib_extra_usages || !*appleib_extra_usages)
+		return 0;
+
+	params = kstrdup(appleib_extra_usages, GFP_KERNEL);
+	if (!params)
+		return -ENOMEM;
+
+	cur = params;
+	while ((tok = strsep(&cur, ",")) != NULL) {
+		tok = strim(tok);
+		if (!*tok)
+			continue;
+
+		if (sscanf(tok, "%x:%x:%x", &usage, &vendor, &product) != 3 ||
+		    vendor > 0xffff || product > 0xffff) {
+			dev_warn(dev, "Ignoring malformed extra_usages entry '%s'\n",
+				 tok);
+			continue;
+		}
+
+		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+		if (!entry) {
+			kfree(params);
+			return -ENOMEM;
+		}
+
+		entry->usage = usage;
+		entry->extra_id.bus = BUS_USB;
+		entry->extra_id.vendor = vendor;
+		entry->extra_id.product = product;
+		entry->dev_id = &entry->extra_id;
+
+		list_add_tail(&entry->extra_list, &appleib_extra_usage_list);
+		hash_add(appleib_usage_hash, &entry->node, entry->usage);
+	}
+
+	kfree(params);
+
+	return 0;
+}
+
+/**
+ * appleib_build_usage_map() - Set up the usage to virtual device id hash.
+ * @dev: the device to log errors against
+ *
+ * Returns: 0 on success, or a negative error code.
+ */
+static int appleib_build_usage_map(struct device *dev)
+{
+	int i;
+
+	hash_init(appleib_usage_hash);
+
+	for (i = 0; i < ARRAY_SIZE(appleib_usage_map); i++)
+		hash_add(appleib_usage_hash, &appleib_usage_map[i].node,
+			 appleib_usage_map[i].usage);
+
+	return appleib_parse_extra_usages(dev);
+}
+
+static void appleib_free_usage_map(void)
+{
+	struct appleib_usage_entry *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, &appleib_extra_usage_list,
+				 extra_list) {
+		list_del(&entry->extra_list);
+		kfree(entry);
+	}
+
+	hash_init(appleib_usage_hash);
+}
+
+static int appleib_sub_stats_show(struct seq_file *s, void *unused)
+{
+	struct appleib_sub_dev *sub_dev = s->private;
+	struct appleib_sub_stats *stats = &sub_dev->stats;
+
+	seq_printf(s, "open:                 %d\n", READ_ONCE(sub_dev->open));
+	seq_printf(s, "deferred_delivery:    %d\n", sub_dev->defer);
+	seq_printf(s, "reports_forwarded:    %lld\n",
+		   atomic64_read(&stats->reports_fwd));
+	seq_printf(s, "reports_dropped:      %lld\n",
+		   atomic64_read(&stats->reports_dropped));
+	seq_printf(s, "bytes_forwarded:      %lld\n",
+		   atomic64_read(&stats->bytes_fwd));
+	seq_printf(s, "input_errors:         %lld\n",
+		   atomic64_read(&stats->input_errors));
+	seq_printf(s, "reports_deferred:     %lld\n",
+		   atomic64_read(&stats->reports_deferred));
+	seq_printf(s, "reports_overrun:      %lld\n",
+		   atomic64_read(&stats->reports_overrun));
+	seq_printf(s, "raw_requests:         %lld\n",
+		   atomic64_read(&stats->raw_requests));
+	seq_printf(s, "raw_request_ns:       %lld\n",
+		   atomic64_read(&stats->raw_request_ns));
+	seq_printf(s, "raw_request_max_ns:   %lld\n",
+		   atomic64_read(&stats->raw_request_max_ns));
+	seq_printf(s, "output_reports:       %lld\n",
+		   atomic64_read(&stats->output_reports));
+	seq_printf(s, "output_report_ns:     %lld\n",
+		   atomic64_read(&stats->output_report_ns));
+	seq_printf(s, "output_report_max_ns: %lld\n",
+		   atomic64_read(&stats->output_report_max_ns));
+	seq_printf(s, "power_fullon:         %lld\n",
+		   atomic64_read(&stats->power_fullon));
+	seq_printf(s, "power_normal:         %lld\n",
+		   atomic64_read(&stats->power_normal));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(appleib_sub_stats);
+
+static void appleib_destroy_sub_hdev(struct appleib_sub_dev *sub_dev)
+{
+	struct hid_device *sub_hdev = sub_dev->sub_hdev;
+
+	/*
+	 * The child has been unpublished, so no more reports get queued;
+	 * don't deliver the remaining ones to a device being destroyed.
+	 */
+	cancel_work_sync(&sub_dev->rpt_work);
+	appleib_free_rpts(sub_dev);
+
+	/*
+	 * Keep the hid device around until any request queued after the
+	 * driver's hid_hw_stop() has been dealt with.
+	 */
+	get_device(&sub_hdev->dev);
+	hid_destroy_device(sub_hdev);
+	cancel_work_sync(&sub_dev->req_work);
+	appleib_free_reqs(sub_dev);
+	put_device(&sub_hdev->dev);
+
+	sub_dev->sub_hdev = NULL;
+}
+
+static int appleib_add_sub_dev(struct appleib_sub_dev *sub_dev)
+{
+	struct appleib_hid_dev_info *hdev_info = sub_dev->hdev_info;
+	struct hid_device_id *dev_id = sub_dev->dev_id;
 	struct hid_device *sub_hdev;
 	int rc;
 
 	sub_hdev = hid_allocate_device();
 	if (IS_ERR(sub_hdev))
-		return sub_hdev;
+		return PTR_ERR(sub_hdev);
 
 	sub_hdev->dev.parent = &hdev_info->hdev->dev;
 
@@ -371,34 +1329,105 @@ appleib_add_sub_dev(struct appleib_hid_dev_info *hdev_info,
 
 	sub_hdev->ll_driver = &appleib_ll_driver;
 
+	sub_dev->prio = dev_id->vendor == USB_VENDOR_ID_LINUX_FOUNDATION &&
+			dev_id->product == USB_DEVICE_ID_IBRIDGE_TB ?
+				APPLEIB_PRIO_TB : APPLEIB_PRIO_OTHER;
+	spin_lock_init(&sub_dev->req_lock);
+	INIT_LIST_HEAD(&sub_dev->reqs);
+	INIT_WORK(&sub_dev->req_work, appleib_req_worker);
+	init_waitqueue_head(&sub_dev->req_wait);
+
+	sub_dev->defer = appleib_defer_reports &&
+			 sub_dev->prio != APPLEIB_PRIO_TB;
+	spin_lock_init(&sub_dev->rpt_lock);
+	INIT_LIST_HEAD(&sub_dev->rpts);
+	INIT_WORK(&sub_dev->rpt_work, appleib_rpt_worker);
+
 	snprintf(sub_hdev->name, sizeof(sub_hdev->name),
 		 "iBridge Virtual HID %s/%04x:%04x",
 		 dev_name(sub_hdev->dev.parent), sub_hdev->vendor,
 		 sub_hdev->product);
 
-	sub_hdev->driver_data = hdev_info;
+	sub_dev->sub_hdev = sub_hdev;
+	sub_hdev->driver_data = sub_dev;
 
 	rc = hid_add_device(sub_hdev);
 	if (rc) {
-		hid_destroy_device(sub_hdev);
-		return ERR_PTR(rc);
+		appleib_destroy_sub_hdev(sub_dev);
+		return rc;
 	}
 
-	return sub_hdev;
+	sub_dev->debugfs_dir = debugfs_create_dir(dev_name(&sub_hdev->dev),
+						  appleib_debugfs_root);
+	debugfs_create_file("stats", 0444, sub_dev->debugfs_dir, sub_dev,
+			    &appleib_sub_stats_fops);
+
+	/* publish the new sub-device to appleib_hid_raw_event() */
+	mutex_lock(&hdev_info->sub_devs_lock);
+	list_add_tail_rcu(&sub_dev->list, &hdev_info->sub_devs);
+	mutex_unlock(&hdev_info->sub_devs_lock);
+
+	return 0;
+}
+
+/*
+ * Adding a child runs its driver's probe synchronously, which for the touch
+ * bar includes several USB round trips; so the children are added in
+ * parallel from separate work items.
+ */
+static void appleib_add_sub_dev_work(struct work_struct *work)
+{
+	struct appleib_sub_dev *sub_dev =
+		container_of(work, struct appleib_sub_dev, add_work);
+
+	sub_dev->add_rc = appleib_add_sub_dev(sub_dev);
+}
+
+/**
+ * appleib_remove_sub_devs() - Unpublish and destroy all virtual children.
+ * @hdev_info: the real device's info
+ *
+ * The children are first removed from the RCU list, so that after a single
+ * grace period no raw event can be dispatched to them anymore, and only then
+ * destroyed.
+ */
+static void appleib_remove_sub_devs(struct appleib_hid_dev_info *hdev_info)
+{
+	struct appleib_sub_dev *sub_dev, *tmp;
+	LIST_HEAD(removed);
+
+	mutex_lock(&hdev_info->sub_devs_lock);
+	list_splice_init_rcu(&hdev_info->sub_devs, &removed, synchronize_rcu);
+	mutex_unlock(&hdev_info->sub_devs_lock);
+
+	list_for_each_entry_safe(sub_dev, tmp, &removed, list) {
+		list_del(&sub_dev->list);
+		debugfs_remove_recursive(sub_dev->debugfs_dir);
+
+		appleib_destroy_sub_hdev(sub_dev);
+	}
 }
 
 static struct appleib_hid_dev_info *appleib_add_device(struct hid_device *hdev)
 {
 	struct appleib_hid_dev_info *hdev_info;
+	struct appleib_sub_dev *sub_dev;
 	struct hid_device_id *dev_id;
 	unsigned int usage;
+	int rc = 0;
 	int i;
 
-	hdev_info = devm_kzalloc(&hdev->dev, sizeof(*hdev_info), GFP_KERNEL);
+	hdev_info = devm_kzalloc(&hdev->dev,
+				 struct_size(hdev_info, sub_dev_slots,
+					     hdev->maxcollection),
+				 GFP_KERNEL);
 	if (!hdev_info)
 		return ERR_PTR(-ENOMEM);
 
 	hdev_info->hdev = hdev;
+	INIT_LIST_HEAD(&hdev_info->sub_devs);
+	mutex_init(&hdev_info->sub_devs_lock);
+	appleib_ctrl_arb_init(&hdev_info->ctrl_arb);
 
 	for (i = 0; i < hdev->maxcollection; i++) {
 		usage = hdev->collection[i].usage;
@@ -407,29 +1436,47 @@ static struct appleib_hid_dev_info *appleib_add_device(struct hid_device *hdev)
 		if (!dev_id) {
 			hid_warn(hdev, "Unknown collection encountered with usage %x\n",
 				 usage);
-		} else {
-			hdev_info->sub_hdevs[i] = appleib_add_sub_dev(hdev_info, dev_id);
+			continue;
+		}
 
-			if (IS_ERR(hdev_info->sub_hdevs[i])) {
-				while (i-- > 0)
-					hid_destroy_device(hdev_info->sub_hdevs[i]);
-				return (void *)hdev_info->sub_hdevs[i];
-			}
+		sub_dev = &hdev_info->sub_dev_slots[i];
+		sub_dev->hdev_info = hdev_info;
+		sub_dev->dev_id = dev_id;
+		INIT_WORK(&sub_dev->add_work, appleib_add_sub_dev_work);
+
+		queue_work(system_unbound_wq, &sub_dev->add_work);
+	}
+
+	/* wait for all children, remembering the first error */
+	for (i = 0; i < hdev->maxcollection; i++) {
+		sub_dev = &hdev_info->sub_dev_slots[i];
+		if (!sub_dev->dev_id)
+			continue;
+
+		flush_work(&sub_dev->add_work);
+
+		if (sub_dev->add_rc && !rc) {
+			hid_err(hdev, "ib: failed to add virtual device %04x:%04x (%d)\n",
+				sub_dev->dev_id->vendor, sub_dev->dev_id->product,
+				sub_dev->add_rc);
+			rc = sub_dev->add_rc;
 		}
 	}
 
+	/* children that failed were never published, so this undoes the rest */
+	if (rc) {
+		appleib_remove_sub_devs(hdev_info);
+		return ERR_PTR(rc);
+	}
+
 	return hdev_info;
 }
 
 static void appleib_remove_device(struct hid_device *hdev)
 {
 	struct appleib_hid_dev_info *hdev_info = hid_get_drvdata(hdev);
-	int i;
 
-	for (i = 0; i < ARRAY_SIZE(hdev_info->sub_hdevs); i++) {
-		if (hdev_info->sub_hdevs[i])
-			hid_destroy_device(hdev_info->sub_hdevs[i]);
-	}
+	appleib_remove_sub_devs(hdev_info);
 
 	hid_set_drvdata(hdev, NULL);
 }
@@ -439,13 +1486,15 @@ static int appleib_hid_probe(struct hid_device *hdev,
 {
 	struct appleib_hid_dev_info *hdev_info;
 	struct usb_device *udev;
+	int config;
 	int rc;
 
 	/* check and set usb config first */
 	udev = hid_to_usb_dev(hdev);
+	config = appleib_digitizer ? APPLEIB_OSX_CONFIG : APPLEIB_BASIC_CONFIG;
 
-	if (udev->actconfig->desc.bConfigurationValue != APPLEIB_BASIC_CONFIG) {
-		rc = usb_driver_set_configuration(udev, APPLEIB_BASIC_CONFIG);
+	if (udev->actconfig->desc.bConfigurationValue != config) {
+		rc = usb_driver_set_configuration(udev, config);
 		return rc ? rc : -ENODEV;
 	}
 
@@ -547,22 +1596,37 @@ static int appleib_probe(struct platform_device *pdev)
 	if (IS_ERR(ib_dev))
 		return PTR_ERR(ib_dev);
 
+	ret = appleib_build_usage_map(&pdev->dev);
+	if (ret)
+		goto free_usage_map;
+
+	appleib_debugfs_root = debugfs_create_dir("apple-ibridge", NULL);
+
 	ret = hid_register_driver(&appleib_hid_driver);
 	if (ret) {
 		dev_err(&pdev->dev, "Error registering hid driver: %d\n",
 			ret);
-		return ret;
+		goto remove_debugfs;
 	}
 
 	platform_set_drvdata(pdev, ib_dev);
 
 	return 0;
+
+remove_debugfs:
+	debugfs_remove_recursive(appleib_debugfs_root);
+free_usage_map:
+	appleib_free_usage_map();
+	return ret;
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6,11,0)
 static int appleib_remove(struct platform_device *pdev)
 {
 	hid_unregister_driver(&appleib_hid_driver);
+	debugfs_remove_recursive(appleib_debugfs_root);
+	appleib_free_usage_map();
+	appleib_free_rdesc_cache();
 
 	return 0;
 }
@@ -570,6 +1634,9 @@ static int appleib_remove(struct platform_device *pdev)
 static void appleib_remove(struct platform_device *pdev)
 {
 	hid_unregister_driver(&appleib_hid_driver);
+	debugfs_remove_recursive(appleib_debugfs_root);
+	appleib_free_usage_map();
+	appleib_free_rdesc_cache();
 }
 #endif
 
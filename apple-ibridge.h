@@ -12,4 +12,11 @@
 #define USB_DEVICE_ID_IBRIDGE_TB	0x0301
 #define USB_DEVICE_ID_IBRIDGE_ALS	0x0302
 
+/*
+ * A raw request type understood by the iBridge's virtual HID devices, besides
+ * the HID class requests: a SET_REPORT sent as a vendor request, without a
+ * leading report-id in the data. It is served ahead of all other requests.
+ */
+#define APPLEIB_REQ_VENDOR_SET_REPORT	0x80
+
 #endif
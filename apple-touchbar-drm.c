@@ -0,0 +1,825 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Apple Touch Bar DRM Driver
+ *
+ * Based on the appletbdrm driver, which the protocol definitions and
+ * messages below follow:
+ * Copyright (c) 2023 Kerem Karabay <kekrby@gmail.com>
+ */
+
+/*
+ * On MacBookPro models with a T2 chip (15,x and 16,x) the contents of the
+ * touch bar display can be drawn by the host: besides the HID interfaces
+ * used by apple-touchbar for the mode and brightness, the iBridge exposes a
+ * vendor interface with a pair of bulk endpoints over which frame updates
+ * are sent. This driver presents that display as a regular KMS device.
+ *
+ * The display is attached via USB, so every update costs a bulk transfer
+ * (and keeps the link out of its low power states). Hence only the
+ * damaged part of each frame is sent, and updates are paced: damage that
+ * arrives while an update is still pending is merged into that update,
+ * and at most max_fps updates are sent per second. E.g. a blinking cursor
+ * results in a small rectangle being sent twice a second, not in full
+ * frames.
+ */
+
+#define dev_fmt(fmt) "tbdrm: " fmt
+
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/usb.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_connector.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_gem_atomic_helper.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_gem_shmem_helper.h>
+#include <drm/drm_modes.h>
+#include <drm/drm_probe_helper.h>
+#include <drm/drm_simple_kms_helper.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+#include <drm/clients/drm_client_setup.h>
+#include <drm/drm_fbdev_shmem.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)
+#include <drm/drm_fbdev_shmem.h>
+#else
+#include <drm/drm_fbdev_generic.h>
+#endif
+
+#include "hid-ids.h"
+
+#define APPLETBDRM_MSG_CLEAR_DISPLAY	0x434c5244	/* CLRD */
+#define APPLETBDRM_MSG_GET_INFORMATION	0x47494e46	/* GINF */
+#define APPLETBDRM_MSG_UPDATE_COMPLETE	0x5544434c	/* UDCL */
+#define APPLETBDRM_MSG_SIGNAL_READINESS	0x52454459	/* REDY */
+
+#define APPLETBDRM_BYTES_PER_PIXEL	3	/* BGR888 */
+#define APPLETBDRM_DPI			218
+#define APPLETBDRM_BULK_MSG_TIMEOUT	1000	/* ms */
+#define APPLETBDRM_RETRY_DELAY		100	/* ms, doubled on every retry */
+#define APPLETBDRM_MAX_RETRIES		5
+
+static unsigned int appletbdrm_max_fps = 30;
+module_param_named(max_fps, appletbdrm_max_fps, uint, 0644);
+MODULE_PARM_DESC(max_fps, "Maximum number of display updates sent per second [30]");
+
+struct appletbdrm_msg_request_header {
+	__le16 unk_00;
+	__le16 unk_02;
+	__le32 unk_04;
+	__le32 unk_08;
+	__le32 size;
+} __packed;
+
+struct appletbdrm_msg_response_header {
+	u8 unk_00[16];
+	__le32 msg;
+} __packed;
+
+struct appletbdrm_msg_simple_request {
+	struct appletbdrm_msg_request_header header;
+	__le32 msg;
+	u8 unk_14[8];
+	__le32 size;
+} __packed;
+
+struct appletbdrm_msg_information {
+	struct appletbdrm_msg_response_header header;
+	u8 unk_14[12];
+	__le32 width;
+	__le32 height;
+	u8 bits_per_pixel;
+	__le32 bytes_per_row;
+	__le32 orientation;
+	__le32 bitmap_info;
+	__le32 pixel_format;
+	__le32 width_inches;	/* floating point */
+	__le32 height_inches;	/* floating point */
+} __packed;
+
+struct appletbdrm_frame {
+	__le16 begin_x;
+	__le16 begin_y;
+	__le16 width;
+	__le16 height;
+	__le32 buf_size;
+	u8 buf[];
+} __packed;
+
+struct appletbdrm_fb_request_footer {
+	u8 unk_00[12];
+	__le32 unk_0c;
+	u8 unk_10[12];
+	__le32 unk_1c;
+	__le64 timestamp;
+	u8 unk_28[12];
+	__le32 unk_34;
+	u8 unk_38[20];
+	__le32 unk_4c;
+} __packed;
+
+struct appletbdrm_fb_request {
+	struct appletbdrm_msg_request_header header;
+	__le16 unk_10;
+	u8 msg_id;
+	u8 unk_13[29];
+	/* a frame, followed by the footer */
+	u8 data[];
+} __packed;
+
+struct appletbdrm_fb_request_response {
+	struct appletbdrm_msg_response_header header;
+	u8 unk_14[12];
+	__le64 timestamp;
+} __packed;
+
+struct appletbdrm_device {
+	struct drm_device		drm;
+	struct usb_device		*udev;
+	unsigned int			in_ep;
+	unsigned int			out_ep;
+
+	/* size of the mode, i.e. landscape */
+	unsigned int			width;
+	unsigned int			height;
+
+	struct drm_display_mode		mode;
+	struct drm_connector		connector;
+	struct drm_simple_display_pipe	pipe;
+
+	/* only used by the flush worker (and probe) */
+	struct appletbdrm_fb_request	*request;
+	struct appletbdrm_fb_request_response *response;
+
+	/* protects the following fields */
+	struct mutex			lock;
+	u8				*staging;	/* BGR888 copy of the frame */
+	struct drm_rect			damage;
+	bool				have_damage;
+	unsigned int			retries;	/* of the current damage */
+	bool				broken;		/* until the next enable */
+
+	struct delayed_work		flush_work;
+	ktime_t				last_flush;
+};
+
+static inline struct appletbdrm_device *to_appletbdrm(struct drm_device *drm)
+{
+	return container_of(drm, struct appletbdrm_device, drm);
+}
+
+static int appletbdrm_send_request(struct appletbdrm_device *adev,
+				   struct appletbdrm_msg_request_header *req,
+				   size_t size)
+{
+	int actual_size;
+	int rc;
+
+	rc = usb_bulk_msg(adev->udev, usb_sndbulkpipe(adev->udev, adev->out_ep),
+			  req, size, &actual_size, APPLETBDRM_BULK_MSG_TIMEOUT);
+	if (rc) {
+		drm_err(&adev->drm, "Failed to send message (%d)\n", rc);
+		return rc;
+	}
+
+	if (actual_size != size) {
+		drm_err(&adev->drm, "Short send: %d of %zu bytes\n",
+			actual_size, size);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int appletbdrm_read_response(struct appletbdrm_device *adev,
+				    struct appletbdrm_msg_response_header *resp,
+				    size_t size, u32 expected)
+{
+	int actual_size;
+	int rc;
+
+	rc = usb_bulk_msg(adev->udev, usb_rcvbulkpipe(adev->udev, adev->in_ep),
+			  resp, size, &actual_size, APPLETBDRM_BULK_MSG_TIMEOUT);
+	if (rc) {
+		drm_err(&adev->drm, "Failed to read response (%d)\n", rc);
+		return rc;
+	}
+
+	if (actual_size != size) {
+		drm_err(&adev->drm, "Short response: %d of %zu bytes\n",
+			actual_size, size);
+		return -EBADMSG;
+	}
+
+	if (resp->msg != cpu_to_le32(expected)) {
+		drm_err(&adev->drm, "Unexpected response %#x (expected %#x)\n",
+			le32_to_cpu(resp->msg), expected);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int appletbdrm_send_msg(struct appletbdrm_device *adev, u32 msg)
+{
+	struct appletbdrm_msg_simple_request *request;
+	struct appletbdrm_msg_response_header *response;
+	int rc;
+
+	request = kzalloc(sizeof(*request), GFP_KERNEL);
+	response = kzalloc(sizeof(*response), GFP_KERNEL);
+	if (!request || !response) {
+		rc = -ENOMEM;
+		goto free_bufs;
+	}
+
+	request->header.unk_00 = cpu_to_le16(2);
+	request->header.unk_02 = cpu_to_le16(0x1512);
+	request->header.size = cpu_to_le32(sizeof(*request) -
+					   sizeof(request->header));
+	request->msg = cpu_to_le32(msg);
+	request->size = request->header.size;
+
+	rc = appletbdrm_send_request(adev, &request->header, sizeof(*request));
+	if (rc)
+		goto free_bufs;
+
+	rc = appletbdrm_read_response(adev, response, sizeof(*response), msg);
+
+free_bufs:
+	kfree(response);
+	kfree(request);
+
+	return rc;
+}
+
+static int appletbdrm_get_information(struct appletbdrm_device *adev)
+{
+	struct appletbdrm_msg_simple_request *request;
+	struct appletbdrm_msg_information *info;
+	int rc;
+
+	request = kzalloc(sizeof(*request), GFP_KERNEL);
+	info = kzalloc(sizeof(*info), GFP_KERNEL);
+	if (!request || !info) {
+		rc = -ENOMEM;
+		goto free_bufs;
+	}
+
+	request->header.unk_00 = cpu_to_le16(2);
+	request->header.unk_02 = cpu_to_le16(0x1512);
+	request->header.size = cpu_to_le32(sizeof(*request) -
+					   sizeof(request->header));
+	request->msg = cpu_to_le32(APPLETBDRM_MSG_GET_INFORMATION);
+	request->size = request->header.size;
+
+	rc = appletbdrm_send_request(adev, &request->header, sizeof(*request));
+	if (rc)
+		goto free_bufs;
+
+	rc = appletbdrm_read_response(adev, &info->header, sizeof(*info),
+				      APPLETBDRM_MSG_GET_INFORMATION);
+	if (rc)
+		goto free_bufs;
+
+	if (info->bits_per_pixel != APPLETBDRM_BYTES_PER_PIXEL * 8) {
+		drm_err(&adev->drm, "Unsupported bits per pixel %u\n",
+			info->bits_per_pixel);
+		rc = -EINVAL;
+		goto free_bufs;
+	}
+
+	/* the panel is natively portrait; present it as landscape */
+	adev->width = le32_to_cpu(info->height);
+	adev->height = le32_to_cpu(info->width);
+
+	if (!adev->width || !adev->height ||
+	    adev->width > U16_MAX || adev->height > U16_MAX) {
+		drm_err(&adev->drm, "Invalid display size %ux%u\n",
+			adev->width, adev->height);
+		rc = -EINVAL;
+	}
+
+free_bufs:
+	kfree(info);
+	kfree(request);
+
+	return rc;
+}
+
+static size_t appletbdrm_request_size(size_t buf_size)
+{
+	return sizeof(struct appletbdrm_fb_request) +
+	       sizeof(struct appletbdrm_frame) + buf_size +
+	       sizeof(struct appletbdrm_fb_request_footer);
+}
+
+/**
+ * appletbdrm_send_damage() - Send the given rectangle of the staging buffer
+ * to the display.
+ * @adev: the device
+ * @rect: the damaged area, in mode coordinates
+ *
+ * The staging buffer is accessed under the lock; the transfer itself is
+ * done without it, so that new damage can be merged in meanwhile.
+ *
+ * Returns: 0 on success, or a negative error code.
+ */
+static int appletbdrm_send_damage(struct appletbdrm_device *adev,
+				  const struct drm_rect *rect)
+{
+	struct appletbdrm_fb_request *request = adev->request;
+	struct appletbdrm_fb_request_footer *footer;
+	struct appletbdrm_frame *frame;
+	unsigned int rect_w = drm_rect_width(rect);
+	unsigned int rect_h = drm_rect_height(rect);
+	size_t line_len = rect_w * APPLETBDRM_BYTES_PER_PIXEL;
+	size_t pitch = adev->width * APPLETBDRM_BYTES_PER_PIXEL;
+	size_t buf_size = line_len * rect_h;
+	size_t request_size = appletbdrm_request_size(buf_size);
+	u64 timestamp = ktime_get_ns();
+	unsigned int y;
+	u8 *src;
+	int rc;
+
+	memset(request, 0, sizeof(*request));
+	request->header.unk_00 = cpu_to_le16(2);
+	request->header.unk_02 = cpu_to_le16(0x12);
+	request->header.unk_04 = cpu_to_le32(9);
+	request->header.size = cpu_to_le32(request_size -
+					   sizeof(request->header));
+	request->unk_10 = cpu_to_le16(1);
+	request->msg_id = timestamp & 0xff;
+
+	/* the device's coordinates are rotated relative to the mode */
+	frame = (struct appletbdrm_frame *)request->data;
+	frame->begin_x = cpu_to_le16(rect->y1);
+	frame->begin_y = cpu_to_le16(adev->width - rect->x2);
+	frame->width = cpu_to_le16(rect_h);
+	frame->height = cpu_to_le16(rect_w);
+	frame->buf_size = cpu_to_le32(buf_size);
+
+	mutex_lock(&adev->lock);
+	src = adev->staging + rect->y1 * pitch +
+	      rect->x1 * APPLETBDRM_BYTES_PER_PIXEL;
+	for (y = 0; y < rect_h; y++, src += pitch)
+		memcpy(frame->buf + y * line_len, src, line_len);
+	mutex_unlock(&adev->lock);
+
+	footer = (struct appletbdrm_fb_request_footer *)(frame->buf + buf_size);
+	memset(footer, 0, sizeof(*footer));
+	footer->unk_0c = cpu_to_le32(0xfffe);
+	footer->unk_1c = cpu_to_le32(0x80001);
+	footer->unk_34 = cpu_to_le32(0x80002);
+	footer->unk_4c = cpu_to_le32(0xffff);
+	footer->timestamp = cpu_to_le64(timestamp);
+
+	rc = appletbdrm_send_request(adev, &request->header, request_size);
+	if (rc)
+		return rc;
+
+	rc = appletbdrm_read_response(adev, &adev->response->header,
+				      sizeof(*adev->response),
+				      APPLETBDRM_MSG_UPDATE_COMPLETE);
+	if (rc)
+		return rc;
+
+	if (adev->response->timestamp != footer->timestamp) {
+		drm_err(&adev->drm, "Response timestamp mismatch\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* must be called with the lock held */
+static void appletbdrm_add_damage_no_lock(struct appletbdrm_device *adev,
+					  const struct drm_rect *rect)
+{
+	if (adev->have_damage) {
+		adev->damage.x1 = min(adev->damage.x1, rect->x1);
+		adev->damage.y1 = min(adev->damage.y1, rect->y1);
+		adev->damage.x2 = max(adev->damage.x2, rect->x2);
+		adev->damage.y2 = max(adev->damage.y2, rect->y2);
+	} else {
+		adev->damage = *rect;
+		adev->have_damage = true;
+	}
+}
+
+static void appletbdrm_flush_worker(struct work_struct *work)
+{
+	struct appletbdrm_device *adev =
+		container_of(to_delayed_work(work), struct appletbdrm_device,
+			     flush_work);
+	struct drm_rect rect;
+	unsigned long delay = 0;
+	bool retry = false;
+	int idx;
+	int rc;
+
+	if (!drm_dev_enter(&adev->drm, &idx))
+		return;
+
+	mutex_lock(&adev->lock);
+	rect = adev->damage;
+	if (!adev->have_damage || adev->broken) {
+		mutex_unlock(&adev->lock);
+		goto exit;
+	}
+	adev->have_damage = false;
+	mutex_unlock(&adev->lock);
+
+	adev->last_flush = ktime_get();
+
+	rc = appletbdrm_send_damage(adev, &rect);
+
+	mutex_lock(&adev->lock);
+	if (!rc) {
+		adev->retries = 0;
+	} else if (adev->retries < APPLETBDRM_MAX_RETRIES) {
+		/*
+		 * Put the area back so it isn't lost; it gets merged with any
+		 * damage that arrived meanwhile and is retried with
+		 * exponential backoff, so a failing device isn't hammered.
+		 */
+		appletbdrm_add_damage_no_lock(adev, &rect);
+		delay = msecs_to_jiffies(APPLETBDRM_RETRY_DELAY <<
+					 adev->retries++);
+		retry = true;
+	} else {
+		/* stop keeping the link busy; the next enable starts over */
+		drm_err(&adev->drm,
+			"Display not responding, suspending updates\n");
+		adev->broken = true;
+		adev->have_damage = false;
+	}
+	mutex_unlock(&adev->lock);
+
+	if (retry)
+		schedule_delayed_work(&adev->flush_work, delay);
+
+exit:
+	drm_dev_exit(idx);
+}
+
+static void appletbdrm_schedule_flush(struct appletbdrm_device *adev)
+{
+	unsigned int max_fps = READ_ONCE(appletbdrm_max_fps);
+	s64 elapsed_us, period_us;
+	unsigned long delay = 0;
+
+	if (max_fps) {
+		period_us = USEC_PER_SEC / max_fps;
+		elapsed_us = ktime_us_delta(ktime_get(), adev->last_flush);
+		if (elapsed_us < period_us)
+			delay = usecs_to_jiffies(period_us - elapsed_us);
+	}
+
+	/* if an update is already pending it will pick up the new damage */
+	schedule_delayed_work(&adev->flush_work, delay);
+}
+
+static void appletbdrm_xrgb8888_to_bgr888(u8 *dst, const void *src,
+					  unsigned int pixels)
+{
+	const __le32 *sbuf32 = src;
+	unsigned int x;
+	u32 pix;
+
+	for (x = 0; x < pixels; x++) {
+		pix = le32_to_cpu(sbuf32[x]);
+		*dst++ = (pix & 0x00ff0000) >> 16;
+		*dst++ = (pix & 0x0000ff00) >> 8;
+		*dst++ = (pix & 0x000000ff);
+	}
+}
+
+static void appletbdrm_pipe_update(struct drm_simple_display_pipe *pipe,
+				   struct drm_plane_state *old_state)
+{
+	struct appletbdrm_device *adev = to_appletbdrm(pipe->crtc.dev);
+	struct drm_plane_state *state = pipe->plane.state;
+	struct drm_shadow_plane_state *shadow_state =
+		to_drm_shadow_plane_state(state);
+	struct drm_framebuffer *fb = state->fb;
+	size_t pitch = adev->width * APPLETBDRM_BYTES_PER_PIXEL;
+	struct drm_rect rect;
+	const u8 *src;
+	u8 *dst;
+	unsigned int y;
+	bool broken;
+	int idx;
+
+	if (!fb || !pipe->crtc.state->active)
+		return;
+
+	if (!drm_atomic_helper_damage_merged(old_state, state, &rect))
+		return;
+
+	if (!drm_dev_enter(&adev->drm, &idx))
+		return;
+
+	if (drm_gem_fb_begin_cpu_access(fb, DMA_FROM_DEVICE))
+		goto exit;
+
+	mutex_lock(&adev->lock);
+
+	src = shadow_state->data[0].vaddr;
+	src += rect.y1 * fb->pitches[0] + rect.x1 * fb->format->cpp[0];
+	dst = adev->staging + rect.y1 * pitch +
+	      rect.x1 * APPLETBDRM_BYTES_PER_PIXEL;
+	for (y = rect.y1; y < rect.y2; y++) {
+		appletbdrm_xrgb8888_to_bgr888(dst, src, drm_rect_width(&rect));
+		src += fb->pitches[0];
+		dst += pitch;
+	}
+
+	broken = adev->broken;
+	if (!broken)
+		appletbdrm_add_damage_no_lock(adev, &rect);
+
+	mutex_unlock(&adev->lock);
+
+	drm_gem_fb_end_cpu_access(fb, DMA_FROM_DEVICE);
+
+	if (!broken)
+		appletbdrm_schedule_flush(adev);
+
+exit:
+	drm_dev_exit(idx);
+}
+
+static void appletbdrm_pipe_enable(struct drm_simple_display_pipe *pipe,
+				   struct drm_crtc_state *crtc_state,
+				   struct drm_plane_state *plane_state)
+{
+	struct appletbdrm_device *adev = to_appletbdrm(pipe->crtc.dev);
+
+	/* give a display that stopped responding another chance */
+	mutex_lock(&adev->lock);
+	adev->broken = false;
+	adev->retries = 0;
+	mutex_unlock(&adev->lock);
+
+	/* a modeset implies full damage, so update() sends the whole frame */
+}
+
+static void appletbdrm_pipe_disable(struct drm_simple_display_pipe *pipe)
+{
+	struct appletbdrm_device *adev = to_appletbdrm(pipe->crtc.dev);
+	int idx;
+
+	cancel_delayed_work_sync(&adev->flush_work);
+
+	mutex_lock(&adev->lock);
+	adev->have_damage = false;
+	mutex_unlock(&adev->lock);
+
+	if (!drm_dev_enter(&adev->drm, &idx))
+		return;
+
+	appletbdrm_send_msg(adev, APPLETBDRM_MSG_CLEAR_DISPLAY);
+
+	drm_dev_exit(idx);
+}
+
+static const struct drm_simple_display_pipe_funcs appletbdrm_pipe_funcs = {
+	.enable = appletbdrm_pipe_enable,
+	.disable = appletbdrm_pipe_disable,
+	.update = appletbdrm_pipe_update,
+	DRM_GEM_SIMPLE_DISPLAY_PIPE_SHADOW_PLANE_FUNCS,
+};
+
+static int appletbdrm_connector_get_modes(struct drm_connector *connector)
+{
+	struct appletbdrm_device *adev = to_appletbdrm(connector->dev);
+
+	return drm_connector_helper_get_modes_fixed(connector, &adev->mode);
+}
+
+static const struct drm_connector_helper_funcs appletbdrm_connector_helper_funcs = {
+	.get_modes = appletbdrm_connector_get_modes,
+};
+
+static const struct drm_connector_funcs appletbdrm_connector_funcs = {
+	.reset = drm_atomic_helper_connector_reset,
+	.fill_modes = drm_helper_probe_single_connector_modes,
+	.destroy = drm_connector_cleanup,
+	.atomic_duplicate_state = drm_atomic_helper_connector_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_connector_destroy_state,
+};
+
+static const struct drm_mode_config_funcs appletbdrm_mode_config_funcs = {
+	.fb_create = drm_gem_fb_create_with_dirty,
+	.atomic_check = drm_atomic_helper_check,
+	.atomic_commit = drm_atomic_helper_commit,
+};
+
+static const u32 appletbdrm_formats[] = {
+	DRM_FORMAT_XRGB8888,
+};
+
+DEFINE_DRM_GEM_FOPS(appletbdrm_drm_fops);
+
+static const struct drm_driver appletbdrm_drm_driver = {
+	DRM_GEM_SHMEM_DRIVER_OPS,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+	DRM_FBDEV_SHMEM_DRIVER_OPS,
+#endif
+	.name			= "apple-tb-drm",
+	.desc			= "Apple Touch Bar DRM Driver",
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,14,0)
+	.date			= "20240601",
+#endif
+	.major			= 1,
+	.minor			= 0,
+	.driver_features	= DRIVER_MODESET | DRIVER_GEM | DRIVER_ATOMIC,
+	.fops			= &appletbdrm_drm_fops,
+};
+
+static int appletbdrm_setup_mode_config(struct appletbdrm_device *adev)
+{
+	struct drm_device *drm = &adev->drm;
+	struct drm_connector *connector = &adev->connector;
+	int rc;
+
+	rc = drmm_mode_config_init(drm);
+	if (rc)
+		return rc;
+
+	drm->mode_config.min_width = adev->width;
+	drm->mode_config.max_width = adev->width;
+	drm->mode_config.min_height = adev->height;
+	drm->mode_config.max_height = adev->height;
+	drm->mode_config.preferred_depth = 24;
+	drm->mode_config.funcs = &appletbdrm_mode_config_funcs;
+
+	adev->mode = (struct drm_display_mode) {
+		DRM_SIMPLE_MODE(adev->width, adev->height,
+				DRM_MODE_RES_MM(adev->width, APPLETBDRM_DPI),
+				DRM_MODE_RES_MM(adev->height, APPLETBDRM_DPI))
+	};
+
+	drm_connector_helper_add(connector, &appletbdrm_connector_helper_funcs);
+	rc = drm_connector_init(drm, connector, &appletbdrm_connector_funcs,
+				DRM_MODE_CONNECTOR_USB);
+	if (rc)
+		return rc;
+
+	rc = drm_simple_display_pipe_init(drm, &adev->pipe,
+					  &appletbdrm_pipe_funcs,
+					  appletbdrm_formats,
+					  ARRAY_SIZE(appletbdrm_formats),
+					  NULL, connector);
+	if (rc)
+		return rc;
+
+	drm_plane_enable_fb_damage_clips(&adev->pipe.plane);
+
+	drm_mode_config_reset(drm);
+
+	return 0;
+}
+
+static int appletbdrm_probe(struct usb_interface *intf,
+			    const struct usb_device_id *id)
+{
+	struct usb_endpoint_descriptor *bulk_in, *bulk_out;
+	struct device *dev = &intf->dev;
+	struct appletbdrm_device *adev;
+	struct drm_device *drm;
+	size_t frame_size;
+	int rc;
+
+	rc = usb_find_common_endpoints(intf->cur_altsetting, &bulk_in,
+				       &bulk_out, NULL, NULL);
+	if (rc) {
+		dev_err(dev, "Failed to find bulk endpoints (%d)\n", rc);
+		return rc;
+	}
+
+	adev = devm_drm_dev_alloc(dev, &appletbdrm_drm_driver,
+				  struct appletbdrm_device, drm);
+	if (IS_ERR(adev))
+		return PTR_ERR(adev);
+
+	drm = &adev->drm;
+	adev->udev = interface_to_usbdev(intf);
+	adev->in_ep = bulk_in->bEndpointAddress;
+	adev->out_ep = bulk_out->bEndpointAddress;
+
+	rc = drmm_mutex_init(drm, &adev->lock);
+	if (rc)
+		return rc;
+
+	INIT_DELAYED_WORK(&adev->flush_work, appletbdrm_flush_worker);
+
+	usb_set_intfdata(intf, adev);
+
+	rc = appletbdrm_get_information(adev);
+	if (rc)
+		return rc;
+
+	rc = appletbdrm_send_msg(adev, APPLETBDRM_MSG_SIGNAL_READINESS);
+	if (rc)
+		return rc;
+
+	rc = appletbdrm_send_msg(adev, APPLETBDRM_MSG_CLEAR_DISPLAY);
+	if (rc)
+		return rc;
+
+	frame_size = adev->width * adev->height * APPLETBDRM_BYTES_PER_PIXEL;
+
+	adev->staging = drmm_kzalloc(drm, frame_size, GFP_KERNEL);
+	adev->request = drmm_kzalloc(drm, appletbdrm_request_size(frame_size),
+				     GFP_KERNEL);
+	adev->response = drmm_kzalloc(drm, sizeof(*adev->response),
+				      GFP_KERNEL);
+	if (!adev->staging || !adev->request || !adev->response)
+		return -ENOMEM;
+
+	rc = appletbdrm_setup_mode_config(adev);
+	if (rc) {
+		dev_err(dev, "Failed to set up mode config (%d)\n", rc);
+		return rc;
+	}
+
+	rc = drm_dev_register(drm, 0);
+	if (rc) {
+		dev_err(dev, "Failed to register drm device (%d)\n", rc);
+		return rc;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+	drm_client_setup(drm, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)
+	drm_fbdev_shmem_setup(drm, 0);
+#else
+	drm_fbdev_generic_setup(drm, 0);
+#endif
+
+	return 0;
+}
+
+static void appletbdrm_disconnect(struct usb_interface *intf)
+{
+	struct appletbdrm_device *adev = usb_get_intfdata(intf);
+
+	drm_dev_unplug(&adev->drm);
+	drm_atomic_helper_shutdown(&adev->drm);
+	cancel_delayed_work_sync(&adev->flush_work);
+}
+
+#ifdef CONFIG_PM
+static int appletbdrm_suspend(struct usb_interface *intf,
+			      pm_message_t message)
+{
+	struct appletbdrm_device *adev = usb_get_intfdata(intf);
+
+	return drm_mode_config_helper_suspend(&adev->drm);
+}
+
+static int appletbdrm_resume(struct usb_interface *intf)
+{
+	struct appletbdrm_device *adev = usb_get_intfdata(intf);
+
+	return drm_mode_config_helper_resume(&adev->drm);
+}
+#endif
+
+static const struct usb_device_id appletbdrm_usb_ids[] = {
+	/* MacBook Pro's 2018, 2019, with T2 chip: iBridge Display */
+	{ USB_DEVICE_INTERFACE_CLASS(USB_VENDOR_ID_APPLE,
+				     USB_DEVICE_ID_APPLE_TOUCHBAR_DISPLAY,
+				     USB_CLASS_AUDIO_VIDEO) },
+	{ },
+};
+
+MODULE_DEVICE_TABLE(usb, appletbdrm_usb_ids);
+
+static struct usb_driver appletbdrm_usb_driver = {
+	.name = "apple-touchbar-drm",
+	.id_table = appletbdrm_usb_ids,
+	.probe = appletbdrm_probe,
+	.disconnect = appletbdrm_disconnect,
+#ifdef CONFIG_PM
+	.suspend = appletbdrm_suspend,
+	.resume = appletbdrm_resume,
+	.reset_resume = appletbdrm_resume,
+#endif
+};
+
+module_usb_driver(appletbdrm_usb_driver);
+
+MODULE_AUTHOR("Kerem Karabay <kekrby@gmail.com>");
+MODULE_DESCRIPTION("Apple Touch Bar DRM driver");
+MODULE_LICENSE("GPL");
@@ -22,26 +22,47 @@
  * allow for controlling of the touch bar's brightness: off (though touches
  * are still reported), dimmed, and full brightness. This driver makes
  * use of these two reports.
+ *
+ * On T2 models the contents of the display can also be drawn directly;
+ * that is handled by the separate apple-touchbar-drm driver.
  */
 
 #define dev_fmt(fmt) "tb: " fmt
 
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
 #include <linux/device.h>
+#include <linux/fb.h>
 #include <linux/hid.h>
+#include <linux/hid-sensor-ids.h>
 #include <linux/input.h>
+#include <linux/idr.h>
+#include <linux/input/mt.h>
 #include <linux/jiffies.h>
+#include <linux/kref.h>
 #include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/power_supply.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/sysfs.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 
 #include "hid-ids.h"
 #include "apple-ibridge.h"
+#include "apple-touchbar.h"
 
 #define HID_UP_APPLE		0xff120000
 #define HID_USAGE_MODE		(HID_UP_CUSTOM | 0x0004)
@@ -51,19 +72,6 @@
 
 #define APPLETB_MAX_TB_KEYS	13	/* ESC, F1-F12 */
 
-#define APPLETB_CMD_MODE_ESC	0
-#define APPLETB_CMD_MODE_FN	1
-#define APPLETB_CMD_MODE_SPCL	2
-#define APPLETB_CMD_MODE_OFF	3
-#define APPLETB_CMD_MODE_UPD	254
-#define APPLETB_CMD_MODE_NONE	255
-
-#define APPLETB_CMD_DISP_ON	1
-#define APPLETB_CMD_DISP_DIM	2
-#define APPLETB_CMD_DISP_OFF	4
-#define APPLETB_CMD_DISP_UPD	254
-#define APPLETB_CMD_DISP_NONE	255
-
 #define APPLETB_FN_MODE_FKEYS	0
 #define APPLETB_FN_MODE_NORM	1
 #define APPLETB_FN_MODE_INV	2
@@ -72,10 +80,44 @@
 #define APPLETB_FN_MODE_MAX	APPLETB_FN_MODE_ESC
 
 #define APPLETB_DEVID_KEYBOARD	1
-#define APPLETB_DEVID_TOUCHPAD	2
+#define APPLETB_DEVID_POINTER	2
+#define APPLETB_DEVID_LID	3
+
+/* classes of input sources */
+#define APPLETB_SRC_INT_KBD	0
+#define APPLETB_SRC_INT_PTR	1
+#define APPLETB_SRC_EXT_KBD	2
+#define APPLETB_SRC_EXT_PTR	3
+#define APPLETB_SRC_COUNT	4	/* classes with input_rules */
+#define APPLETB_SRC_LID		4
+
+/* kinds of input events that can count as activity */
+#define APPLETB_ACT_KEY		BIT(0)
+#define APPLETB_ACT_BUTTON	BIT(1)
+#define APPLETB_ACT_MOTION	BIT(2)
+#define APPLETB_ACT_ALL		(APPLETB_ACT_KEY | APPLETB_ACT_BUTTON | \
+				 APPLETB_ACT_MOTION)
+
+/* activity from a source more often than this is coalesced */
+#define APPLETB_ACT_INTERVAL	(HZ / 10)
 
 #define APPLETB_MAX_DIM_TIME	30
 
+#define APPLETB_ALS_MAX_AGE	10	/* seconds */
+#define APPLETB_ALS_EMA_SHIFT	2	/* weight of new samples is 1/4 */
+#define APPLETB_ALS_HYST_PCT	25
+
+#define APPLETB_RING_RECORDS	1024	/* must be a power of 2 */
+
+#define APPLETB_MT_MAX_CONTACTS	10
+#define APPLETB_MT_SCANTIME_US	100	/* HID scan time unit */
+
+#define APPLETB_PREWAKE_WINDOW_MS	3000
+
+/* states tracked for residency: modes ESC..OFF, displays ON, DIM, OFF */
+#define APPLETB_NR_MODES	(APPLETB_CMD_MODE_OFF + 1)
+#define APPLETB_NR_DISPS	3
+
 #define APPLETB_FEATURE_IS_T1	BIT(0)
 
 static int appletb_tb_def_idle_timeout = 5 * 60;
@@ -105,6 +147,56 @@ MODULE_PARM_DESC(fnmode, "Default Fn key mode:\n"
 			 "    3 - special keys only\n"
 			 "    4 - escape key only");
 
+static int appletb_tb_def_als_dim_lux;
+module_param_named(als_dim_lux, appletb_tb_def_als_dim_lux, int, 0444);
+MODULE_PARM_DESC(als_dim_lux, "Default ambient light level for dimming:\n"
+			      "    >0 - dim the touch bar display instead of turning it fully on while the ambient light\n"
+			      "         sensor reads below this level (T1 models only)\n"
+			      "    [0] - don't use the ambient light sensor");
+
+static int appletb_tb_def_fn_hysteresis_ms;
+module_param_named(fn_hysteresis_ms, appletb_tb_def_fn_hysteresis_ms, int, 0444);
+MODULE_PARM_DESC(fn_hysteresis_ms, "Default Fn key hysteresis:\n"
+				   "    >0 - only switch modes once the Fn key has been held for this many milliseconds,\n"
+				   "         or a touch bar key is pressed while it is held\n"
+				   "    [0] - switch modes as soon as the Fn key is pressed");
+
+static char *appletb_tb_def_input_rules;
+module_param_named(input_rules, appletb_tb_def_input_rules, charp, 0444);
+MODULE_PARM_DESC(input_rules, "Default input events that count as activity:\n"
+			      "    whitespace separated list of <source>=<mask>, where source is one of int_kbd, int_ptr,\n"
+			      "    ext_kbd, ext_ptr (internal/external keyboards/pointers) and mask is a combination of\n"
+			      "    1 (keys), 2 (buttons), 4 (motion); [int_kbd=7 int_ptr=7 ext_kbd=0 ext_ptr=0]");
+
+static int appletb_tb_bat_idle_timeout = -3;
+module_param_named(idle_timeout_battery, appletb_tb_bat_idle_timeout, int, 0444);
+MODULE_PARM_DESC(idle_timeout_battery, "Default touch bar idle timeout while running on battery:\n"
+				       "    see idle_timeout\n"
+				       "    [-3] - same as idle_timeout");
+
+static int appletb_tb_bat_dim_timeout = -3;
+module_param_named(dim_timeout_battery, appletb_tb_bat_dim_timeout, int, 0444);
+MODULE_PARM_DESC(dim_timeout_battery, "Default touch bar dim timeout while running on battery:\n"
+				      "    see dim_timeout\n"
+				      "    [-3] - same as dim_timeout");
+
+static int appletb_tb_bat_fn_mode = -1;
+module_param_named(fnmode_battery, appletb_tb_bat_fn_mode, int, 0444);
+MODULE_PARM_DESC(fnmode_battery, "Default Fn key mode while running on battery:\n"
+				 "    see fnmode\n"
+				 "    [-1] - same as fnmode");
+
+static bool appletb_tb_prewake = true;
+module_param_named(prewake, appletb_tb_prewake, bool, 0644);
+MODULE_PARM_DESC(prewake, "Start resuming the touch bar's USB interfaces on the first key press or trackpad\n"
+			  "    touch that doesn't count as activity (see input_rules) while the touch bar display\n"
+			  "    is off, ahead of the likely touch bar use [Y]");
+
+static bool appletb_tb_wake_deliver;
+module_param_named(wake_deliver, appletb_tb_wake_deliver, bool, 0644);
+MODULE_PARM_DESC(wake_deliver, "Deliver the touch bar key press that turns the display back on, translated according\n"
+			       "    to the mode being switched to, instead of only using it to wake the display [N]");
+
 static ssize_t idle_timeout_show(struct device *dev,
 				 struct device_attribute *attr, char *buf);
 static ssize_t idle_timeout_store(struct device *dev,
@@ -125,10 +217,71 @@ static ssize_t fnmode_store(struct device *dev, struct device_attribute *attr,
 			    const char *buf, size_t size);
 static DEVICE_ATTR_RW(fnmode);
 
+static ssize_t fn_hysteresis_ms_show(struct device *dev,
+				     struct device_attribute *attr, char *buf);
+static ssize_t fn_hysteresis_ms_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t size);
+static DEVICE_ATTR_RW(fn_hysteresis_ms);
+
+static ssize_t als_dim_lux_show(struct device *dev,
+				struct device_attribute *attr, char *buf);
+static ssize_t als_dim_lux_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t size);
+static DEVICE_ATTR_RW(als_dim_lux);
+
+static ssize_t state_show(struct device *dev, struct device_attribute *attr,
+			  char *buf);
+static DEVICE_ATTR_RO(state);
+
+static ssize_t config_show(struct device *dev, struct device_attribute *attr,
+			   char *buf);
+static ssize_t config_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t size);
+static DEVICE_ATTR_RW(config);
+
+static ssize_t input_rules_show(struct device *dev,
+				struct device_attribute *attr, char *buf);
+static ssize_t input_rules_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t size);
+static DEVICE_ATTR_RW(input_rules);
+
+static ssize_t input_sources_show(struct device *dev,
+				  struct device_attribute *attr, char *buf);
+static DEVICE_ATTR_RO(input_sources);
+
+static ssize_t prewake_stats_show(struct device *dev,
+				  struct device_attribute *attr, char *buf);
+static DEVICE_ATTR_RO(prewake_stats);
+
+static ssize_t first_tap_stats_show(struct device *dev,
+				    struct device_attribute *attr, char *buf);
+static DEVICE_ATTR_RO(first_tap_stats);
+
+static ssize_t residency_show(struct device *dev,
+			      struct device_attribute *attr, char *buf);
+static DEVICE_ATTR_RO(residency);
+
+static ssize_t power_profile_show(struct device *dev,
+				  struct device_attribute *attr, char *buf);
+static DEVICE_ATTR_RO(power_profile);
+
 static struct attribute *appletb_attrs[] = {
 	&dev_attr_idle_timeout.attr,
 	&dev_attr_dim_timeout.attr,
 	&dev_attr_fnmode.attr,
+	&dev_attr_fn_hysteresis_ms.attr,
+	&dev_attr_als_dim_lux.attr,
+	&dev_attr_state.attr,
+	&dev_attr_config.attr,
+	&dev_attr_input_rules.attr,
+	&dev_attr_input_sources.attr,
+	&dev_attr_prewake_stats.attr,
+	&dev_attr_first_tap_stats.attr,
+	&dev_attr_residency.attr,
+	&dev_attr_power_profile.attr,
 	NULL,
 };
 
@@ -136,13 +289,42 @@ static const struct attribute_group appletb_attr_group = {
 	.attrs = appletb_attrs,
 };
 
+#define APPLETB_CFG_IDLE_TIMEOUT	BIT(0)
+#define APPLETB_CFG_DIM_TIMEOUT		BIT(1)
+#define APPLETB_CFG_FN_MODE		BIT(2)
+#define APPLETB_CFG_FN_HYSTERESIS	BIT(3)
+#define APPLETB_CFG_ALS_DIM_LUX		BIT(4)
+
+/* a set of settings to be applied together; only those in mask are set */
+struct appletb_config {
+	unsigned int	mask;
+	int		idle_timeout;
+	int		dim_timeout;
+	int		fn_mode;
+	int		fn_hysteresis_ms;
+	int		als_dim_lux;
+};
+
+/* settings switched with the power source */
+#define APPLETB_CFG_PROFILE	(APPLETB_CFG_IDLE_TIMEOUT | \
+				 APPLETB_CFG_DIM_TIMEOUT | APPLETB_CFG_FN_MODE)
+
+#define APPLETB_PROFILE_AC	0
+#define APPLETB_PROFILE_BATTERY	1
+
 struct appletb_device {
+	/* the usb device (or hub) common to all interfaces of this touch bar */
+	struct device		*parent;
+	struct list_head	list;
+	struct kref		kref;
+
 	bool			active;
 	struct device		*log_dev;
 
 	struct hid_field	*mode_field;
 	struct hid_field	*disp_field;
 	struct hid_field	*disp_field_aux1;
+	struct hid_field	*als_field;
 	struct appletb_iface_info {
 		struct hid_device	*hdev;
 		struct usb_interface	*usb_iface;
@@ -150,33 +332,165 @@ struct appletb_device {
 	}			mode_iface, disp_iface;
 
 	struct input_handler	inp_handler;
-	struct input_handle	kbd_handle;
-	struct input_handle	tpd_handle;
+	/* list of appletb_inp_source, protected by inp_lock */
+	struct list_head	inp_sources;
+	struct mutex		inp_lock;
+	/* APPLETB_ACT_* mask per APPLETB_SRC_* class */
+	u8			inp_rules[APPLETB_SRC_COUNT];
+
+	/*
+	 * Digitizer, only present when the iBridge is in the OS X
+	 * configuration. Only accessed from the hid event path.
+	 */
+	struct appletb_mt_info {
+		struct hid_device	*hdev;
+		struct input_dev	*input;
+		/* contact currently being assembled from the report */
+		unsigned int		cur_collection;
+		bool			cur_valid;
+		bool			cur_tip;
+		int			cur_id;
+		int			cur_x;
+		int			cur_y;
+		/* MSC_TIMESTAMP, derived from the report scan times */
+		u32			timestamp;
+		int			last_scantime;
+		bool			have_scantime;
+	}			mt;
 
 	bool			last_tb_keys_pressed[APPLETB_MAX_TB_KEYS];
 	bool			last_tb_keys_translated[APPLETB_MAX_TB_KEYS];
-	bool			last_fn_pressed;
+	/* key presses delivered while the display was off (wake_deliver) */
+	bool			last_tb_keys_woken[APPLETB_MAX_TB_KEYS];
+	unsigned long		first_tap_delivered;
+	unsigned long		first_tap_suppressed;
+	bool			last_fn_pressed;	/* as far as the mode goes */
+	bool			fn_down;		/* physical state */
+	struct delayed_work	fn_work;
 
 	ktime_t			last_event_time;
 
+	/*
+	 * Only changed via appletb_set_state_no_lock(), so the state attribute
+	 * can read them under state_seq instead of taking tb_lock.
+	 */
 	unsigned char		cur_tb_mode;
 	unsigned char		pnd_tb_mode;
 	unsigned char		cur_tb_disp;
 	unsigned char		pnd_tb_disp;
+	seqcount_spinlock_t	state_seq;
+	/* the state attribute, for notifying pollers; protected by tb_lock */
+	struct kernfs_node	*state_kn;
+	/* time spent in each cur mode/disp, and changes; protected by tb_lock */
+	u64			mode_residency_ns[APPLETB_NR_MODES];
+	u64			disp_residency_ns[APPLETB_NR_DISPS];
+	ktime_t			mode_since;
+	ktime_t			disp_since;
+	unsigned long		mode_transitions;
+	unsigned long		disp_transitions;
 	bool			tb_autopm_off;
 	bool			restore_autopm;
+	/* skip the delay between setting mode and display in the next update */
+	bool			fast_restore;
+	/* force the display off; protected by tb_lock */
+	bool			lid_closed;
+	bool			panel_blanked;
+	struct notifier_block	fb_notifier;
 	struct delayed_work	tb_work;
 	/* protects most of the above */
 	spinlock_t		tb_lock;
 
+	/*
+	 * Speculative resume of the interfaces on input activity while the
+	 * display is off; protected by tb_lock.
+	 */
+	bool			prewake_pending;
+	struct usb_interface	*prewake_ifaces[2];
+	struct delayed_work	prewake_work;
+	unsigned long		prewake_hits;
+	unsigned long		prewake_misses;
+
 	int			dim_timeout;
 	int			idle_timeout;
 	bool			dim_to_is_calc;
 	int			fn_mode;
+	int			fn_hysteresis_ms;
+
+	/*
+	 * Settings for the power source not in use, and which one is in use;
+	 * protected by tb_lock.
+	 */
+	struct appletb_config	profiles[2];
+	int			cur_profile;
+	struct notifier_block	psy_notifier;
+	struct work_struct	psy_work;
+
+	/* ambient light, in Q8 fixed point; protected by tb_lock */
+	int			als_dim_lux;
+	u32			als_avg;
+	bool			als_valid;
+	bool			als_dark;
+	ktime_t			als_time;
+	/* when the last reading was requested, 0 if never */
+	ktime_t			als_req_time;
+	struct work_struct	als_work;
+
+	/* event stream, see apple-touchbar.h */
+	struct miscdevice	events_dev;
+	char			events_dev_name[24];
+	int			events_dev_id;
+	struct appletb_ring_header *ring;
+	struct appletb_event	*ring_data;
+	size_t			ring_size;
+	u64			ring_head;
+	/* protects ring_head and the ring contents */
+	spinlock_t		ring_lock;
+	wait_queue_head_t	ring_wait;
 
 	bool			is_t1;
 };
 
+/* an input device whose events may count as activity */
+struct appletb_inp_source {
+	struct input_handle	handle;
+	struct appletb_device	*tb_dev;
+	struct list_head	list;
+	unsigned int		class;
+
+	/* only touched from the input event path, which is serialized */
+	unsigned long		last_activity;
+	unsigned long		events;
+	unsigned long		activity;
+	unsigned long		window_start;
+	unsigned int		window_events;
+	unsigned int		rate;
+};
+
+static const char * const appletb_src_names[] = {
+	[APPLETB_SRC_INT_KBD] = "int_kbd",
+	[APPLETB_SRC_INT_PTR] = "int_ptr",
+	[APPLETB_SRC_EXT_KBD] = "ext_kbd",
+	[APPLETB_SRC_EXT_PTR] = "ext_ptr",
+	[APPLETB_SRC_LID] = "lid",
+};
+
+static const u8 appletb_def_inp_rules[APPLETB_SRC_COUNT] = {
+	[APPLETB_SRC_INT_KBD] = APPLETB_ACT_ALL,
+	[APPLETB_SRC_INT_PTR] = APPLETB_ACT_ALL,
+	[APPLETB_SRC_EXT_KBD] = 0,
+	[APPLETB_SRC_EXT_PTR] = 0,
+};
+
+/* cache of appletb_is_internal_device() results, keyed by input id */
+struct appletb_match_entry {
+	struct list_head	list;
+	struct input_id		id;
+	bool			internal;
+};
+
+static LIST_HEAD(appletb_match_cache);
+static DEFINE_MUTEX(appletb_match_lock);
+
 struct appletb_key_translation {
 	u16 from;
 	u16 to;
@@ -197,7 +511,142 @@ static const struct appletb_key_translation appletb_fn_codes[] = {
 	{ KEY_F12, KEY_VOLUMEUP },
 };
 
-static struct appletb_device *appletb_dev;
+/*
+ * Whether a key event may be delivered as @code: any key, so that a BPF key
+ * policy can translate to custom ones, but no buttons, as those would make
+ * userspace take the touch bar for a pointer or joystick. The touch bar's
+ * input device advertises all of these.
+ */
+static bool appletb_is_key_code(unsigned int code)
+{
+	if (code == KEY_RESERVED || code > KEY_MAX)
+		return false;
+	if (code >= BTN_MISC && code < KEY_OK)
+		return false;
+	if (code >= BTN_DPAD_UP && code <= BTN_DPAD_RIGHT)
+		return false;
+	if (code >= BTN_TRIGGER_HAPPY && code <= BTN_TRIGGER_HAPPY40)
+		return false;
+	return true;
+}
+
+/* all touch bars with at least one interface probed */
+static LIST_HEAD(appletb_devices);
+static DEFINE_MUTEX(appletb_devices_lock);
+static DEFINE_IDA(appletb_events_ida);
+
+static void appletb_log_event(struct appletb_device *tb_dev, u16 type,
+			      u16 code, u16 aux, u8 action, s32 value)
+{
+	struct appletb_event *evt;
+	unsigned long flags;
+	unsigned int idx;
+
+	spin_lock_irqsave(&tb_dev->ring_lock, flags);
+
+	idx = tb_dev->ring_head & (APPLETB_RING_RECORDS - 1);
+	evt = &tb_dev->ring_data[idx];
+	evt->timestamp = ktime_get_ns();
+	evt->type = type;
+	evt->code = code;
+	evt->aux = aux;
+	evt->action = action;
+	evt->value = value;
+
+	/* publish the record before the new head */
+	tb_dev->ring_head++;
+	smp_wmb();
+	WRITE_ONCE(tb_dev->ring->head, tb_dev->ring_head);
+
+	spin_unlock_irqrestore(&tb_dev->ring_lock, flags);
+
+	wake_up_interruptible(&tb_dev->ring_wait);
+}
+
+struct appletb_state {
+	unsigned char	cur_tb_mode;
+	unsigned char	pnd_tb_mode;
+	unsigned char	cur_tb_disp;
+	unsigned char	pnd_tb_disp;
+};
+
+static const unsigned char appletb_residency_disps[APPLETB_NR_DISPS] = {
+	APPLETB_CMD_DISP_ON, APPLETB_CMD_DISP_DIM, APPLETB_CMD_DISP_OFF,
+};
+
+static int appletb_disp_to_index(unsigned char disp)
+{
+	int i;
+
+	for (i = 0; i < APPLETB_NR_DISPS; i++)
+		if (appletb_residency_disps[i] == disp)
+			return i;
+
+	return -1;
+}
+
+/* Account the time since @since to state @idx (if tracked) and restart. */
+static void appletb_account_residency(u64 *residency, int idx,
+				      ktime_t *since)
+{
+	ktime_t now = ktime_get();
+
+	if (idx >= 0)
+		residency[idx] += ktime_to_ns(ktime_sub(now, *since));
+	*since = now;
+}
+
+/*
+ * Update one of the mode/disp state fields. The write side of state_seq is
+ * only entered on actual changes, so readers rarely have to retry.
+ */
+static void appletb_set_state_no_lock(struct appletb_device *tb_dev,
+				      unsigned char *field, unsigned char value)
+{
+	unsigned char old = *field;
+
+	if (old == value)
+		return;
+
+	write_seqcount_begin(&tb_dev->state_seq);
+	*field = value;
+	write_seqcount_end(&tb_dev->state_seq);
+
+	if (field == &tb_dev->cur_tb_mode) {
+		appletb_account_residency(tb_dev->mode_residency_ns,
+					  old < APPLETB_NR_MODES ? old : -1,
+					  &tb_dev->mode_since);
+		tb_dev->mode_transitions++;
+		appletb_log_event(tb_dev, APPLETB_EVT_MODE, value, old, 0, 0);
+	} else if (field == &tb_dev->cur_tb_disp) {
+		appletb_account_residency(tb_dev->disp_residency_ns,
+					  appletb_disp_to_index(old),
+					  &tb_dev->disp_since);
+		tb_dev->disp_transitions++;
+		appletb_log_event(tb_dev, APPLETB_EVT_DISP, value, old, 0, 0);
+	} else {
+		return;
+	}
+
+	/* wake up pollers only on changes confirmed by the device */
+	if (tb_dev->state_kn)
+		sysfs_notify_dirent(tb_dev->state_kn);
+}
+
+static void appletb_get_state(struct appletb_device *tb_dev,
+			      struct appletb_state *state)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&tb_dev->state_seq);
+
+		state->cur_tb_mode = tb_dev->cur_tb_mode;
+		state->pnd_tb_mode = tb_dev->pnd_tb_mode;
+		state->cur_tb_disp = tb_dev->cur_tb_disp;
+		state->pnd_tb_disp = tb_dev->pnd_tb_disp;
+	} while (read_seqcount_retry(&tb_dev->state_seq, seq));
+}
 
 static bool appletb_disable_autopm(struct hid_device *hdev)
 {
@@ -217,10 +666,10 @@ static bool appletb_disable_autopm(struct hid_device *hdev)
  * While the mode functionality is listed as a valid hid report in the usb
  * interface descriptor, on a T1 it's not sent that way. Instead it's sent with
  * different request-type and without a leading report-id in the data. Hence
- * we need to send it as a custom usb control message rather via any of the
- * standard hid_hw_*request() functions. The device might return EPIPE for a
- * while after setting the display mode on T1 models, so retrying should be
- * done on those models.
+ * we need to send it as a custom usb control message, which the iBridge
+ * driver does for the APPLEIB_REQ_VENDOR_SET_REPORT request type (ahead of
+ * any ALS polls). The device might return EPIPE for a while after setting
+ * the display mode on T1 models, so retrying should be done on those models.
  */
 static int appletb_set_tb_mode(struct appletb_device *tb_dev,
 			       unsigned char mode)
@@ -249,14 +698,12 @@ static int appletb_set_tb_mode(struct appletb_device *tb_dev,
 
 	if (tb_dev->is_t1) {
 		int tries = 0;
-		struct usb_device *dev = interface_to_usbdev(tb_dev->mode_iface.usb_iface);
-		__u8 ifnum = tb_dev->mode_iface.usb_iface->cur_altsetting->desc.bInterfaceNumber;
 
 		do {
-			rc = usb_control_msg(dev, usb_sndctrlpipe(dev, 0), HID_REQ_SET_REPORT,
-					     USB_DIR_OUT | USB_RECIP_INTERFACE | USB_TYPE_VENDOR,
-					     (report->type + 1) << 8 | report->id,
-					     ifnum, buf, 1, 2000);
+			rc = hid_hw_raw_request(tb_dev->mode_iface.hdev,
+						report->id, (__u8 *) buf, 1,
+						report->type,
+						APPLEIB_REQ_VENDOR_SET_REPORT);
 
 			if (rc != -EPIPE)
 				break;
@@ -324,6 +771,87 @@ static int appletb_set_tb_disp(struct appletb_device *tb_dev,
 	return rc;
 }
 
+/*
+ * Start resuming the interfaces when the touch bar is likely to be used
+ * soon, so that the first touch doesn't have to wait for the USB resume.
+ * This is only done for input that doesn't count as activity, as activity
+ * turns the display back on (and so resumes the interfaces) anyway. The
+ * references are dropped again on the first touch bar use while the display
+ * is still off (a hit), or when the touch bar is used only after something
+ * else turned the display on, or not at all within
+ * APPLETB_PREWAKE_WINDOW_MS (a miss).
+ */
+static void appletb_prewake_no_lock(struct appletb_device *tb_dev)
+{
+	struct usb_interface *ifaces[] = {
+		tb_dev->mode_iface.usb_iface,
+		tb_dev->disp_iface.usb_iface,
+	};
+	int i;
+
+	if (!READ_ONCE(appletb_tb_prewake) || tb_dev->prewake_pending ||
+	    tb_dev->cur_tb_disp != APPLETB_CMD_DISP_OFF ||
+	    tb_dev->lid_closed || tb_dev->panel_blanked)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(ifaces); i++) {
+		if (!ifaces[i] || (i > 0 && ifaces[i] == ifaces[0]))
+			continue;
+		if (usb_autopm_get_interface_async(ifaces[i]) == 0)
+			tb_dev->prewake_ifaces[i] = ifaces[i];
+	}
+
+	tb_dev->prewake_pending = true;
+	schedule_delayed_work(&tb_dev->prewake_work,
+			      msecs_to_jiffies(APPLETB_PREWAKE_WINDOW_MS));
+}
+
+static void appletb_prewake_release_no_lock(struct appletb_device *tb_dev,
+					    bool hit)
+{
+	int i;
+
+	if (!tb_dev->prewake_pending)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(tb_dev->prewake_ifaces); i++) {
+		if (tb_dev->prewake_ifaces[i])
+			usb_autopm_put_interface_async(tb_dev->prewake_ifaces[i]);
+		tb_dev->prewake_ifaces[i] = NULL;
+	}
+
+	tb_dev->prewake_pending = false;
+	if (hit)
+		tb_dev->prewake_hits++;
+	else
+		tb_dev->prewake_misses++;
+}
+
+/*
+ * The touch bar was used. A pending prewake only paid off if the display was
+ * still off, i.e. it was our resume that got ahead of this use.
+ */
+static void appletb_prewake_hit_no_lock(struct appletb_device *tb_dev)
+{
+	if (!tb_dev->prewake_pending)
+		return;
+
+	cancel_delayed_work(&tb_dev->prewake_work);
+	appletb_prewake_release_no_lock(tb_dev,
+			tb_dev->cur_tb_disp == APPLETB_CMD_DISP_OFF);
+}
+
+static void appletb_prewake_worker(struct work_struct *work)
+{
+	struct appletb_device *tb_dev =
+		container_of(work, struct appletb_device, prewake_work.work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	appletb_prewake_release_no_lock(tb_dev, false);
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
 static bool appletb_any_tb_key_pressed(struct appletb_device *tb_dev)
 {
 	return !!memchr_inv(tb_dev->last_tb_keys_pressed, 0,
@@ -344,6 +872,7 @@ static void appletb_set_tb_worker(struct work_struct *work)
 	unsigned char pending_disp;
 	unsigned char current_disp;
 	bool restore_autopm;
+	bool fast_restore;
 	bool any_tb_key_pressed, need_reschedule;
 	int rc1 = 1, rc2 = 1;
 	unsigned long flags;
@@ -354,13 +883,15 @@ static void appletb_set_tb_worker(struct work_struct *work)
 	pending_mode = tb_dev->pnd_tb_mode;
 	pending_disp = tb_dev->pnd_tb_disp;
 	restore_autopm = tb_dev->restore_autopm;
+	fast_restore = tb_dev->fast_restore;
+	tb_dev->fast_restore = false;
 
 	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
 
 	if (pending_mode != APPLETB_CMD_MODE_NONE)
 		rc1 = appletb_set_tb_mode(tb_dev, pending_mode);
 	if (pending_mode != APPLETB_CMD_MODE_NONE &&
-	    pending_disp != APPLETB_CMD_DISP_NONE)
+	    pending_disp != APPLETB_CMD_DISP_NONE && !fast_restore)
 		msleep(25);
 	if (pending_disp != APPLETB_CMD_DISP_NONE)
 		rc2 = appletb_set_tb_disp(tb_dev, pending_disp);
@@ -373,19 +904,23 @@ static void appletb_set_tb_worker(struct work_struct *work)
 	need_reschedule = false;
 
 	if (rc1 == 0) {
-		tb_dev->cur_tb_mode = pending_mode;
+		appletb_set_state_no_lock(tb_dev, &tb_dev->cur_tb_mode,
+					  pending_mode);
 
 		if (tb_dev->pnd_tb_mode == pending_mode)
-			tb_dev->pnd_tb_mode = APPLETB_CMD_MODE_NONE;
+			appletb_set_state_no_lock(tb_dev, &tb_dev->pnd_tb_mode,
+						  APPLETB_CMD_MODE_NONE);
 		else
 			need_reschedule = true;
 	}
 
 	if (rc2 == 0) {
-		tb_dev->cur_tb_disp = pending_disp;
+		appletb_set_state_no_lock(tb_dev, &tb_dev->cur_tb_disp,
+					  pending_disp);
 
 		if (tb_dev->pnd_tb_disp == pending_disp)
-			tb_dev->pnd_tb_disp = APPLETB_CMD_DISP_NONE;
+			appletb_set_state_no_lock(tb_dev, &tb_dev->pnd_tb_disp,
+						  APPLETB_CMD_DISP_NONE);
 		else
 			need_reschedule = true;
 	}
@@ -449,10 +984,18 @@ static void appletb_set_tb_worker(struct work_struct *work)
 		/* dim or idle timeout reached */
 		int next_disp = (time_to_off == 0) ? APPLETB_CMD_DISP_OFF :
 						     APPLETB_CMD_DISP_DIM;
+
 		if (next_disp != current_disp &&
 		    appletb_set_tb_disp(tb_dev, next_disp) == 0) {
+			appletb_log_event(tb_dev, APPLETB_EVT_TIMEOUT,
+					  next_disp, 0, 0,
+					  next_disp == APPLETB_CMD_DISP_OFF ?
+						tb_dev->idle_timeout :
+						tb_dev->dim_timeout);
+
 			spin_lock_irqsave(&tb_dev->tb_lock, flags);
-			tb_dev->cur_tb_disp = next_disp;
+			appletb_set_state_no_lock(tb_dev, &tb_dev->cur_tb_disp,
+						  next_disp);
 			spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
 		}
 
@@ -508,6 +1051,55 @@ static unsigned char appletb_get_fn_tb_mode(struct appletb_device *tb_dev)
 	}
 }
 
+static bool appletb_als_is_dark(struct appletb_device *tb_dev)
+{
+	return tb_dev->als_dim_lux > 0 && tb_dev->als_valid &&
+	       tb_dev->als_dark;
+}
+
+/*
+ * Fetch a fresh ambient light reading if the last one is stale. This is only
+ * triggered by input activity, i.e. while the touch bar is in use, so there
+ * is no periodic polling while the machine is idle. If the ALS is streaming
+ * its readings anyway (e.g. because the apple-ib-als buffer is enabled) the
+ * readings never go stale and no requests are sent.
+ */
+static void appletb_als_refresh_no_lock(struct appletb_device *tb_dev)
+{
+	if (tb_dev->als_dim_lux <= 0 || !tb_dev->als_field)
+		return;
+
+	if (tb_dev->als_valid &&
+	    ktime_ms_delta(ktime_get(), tb_dev->als_time) <
+						APPLETB_ALS_MAX_AGE * 1000)
+		return;
+
+	/*
+	 * Don't keep hammering the control endpoint if the sensor doesn't
+	 * answer (or after als_dim_lux was changed): at most one request per
+	 * APPLETB_ALS_MAX_AGE.
+	 */
+	if (tb_dev->als_req_time &&
+	    ktime_ms_delta(ktime_get(), tb_dev->als_req_time) <
+						APPLETB_ALS_MAX_AGE * 1000)
+		return;
+
+	tb_dev->als_req_time = ktime_get();
+	schedule_work(&tb_dev->als_work);
+}
+
+static void appletb_als_worker(struct work_struct *work)
+{
+	struct appletb_device *tb_dev =
+		container_of(work, struct appletb_device, als_work);
+	struct hid_field *field = READ_ONCE(tb_dev->als_field);
+
+	/* the reply is delivered to appletb_hid_event() */
+	if (field)
+		hid_hw_request(field->report->device, field->report,
+			       HID_REQ_GET_REPORT);
+}
+
 /*
  * Switch touch bar mode and display when mode or display not the desired ones.
  */
@@ -537,9 +1129,14 @@ static void appletb_update_touchbar_no_lock(struct appletb_device *tb_dev,
 		want_mode = appletb_get_fn_tb_mode(tb_dev);
 		want_disp = tb_dev->idle_timeout ==  0 ? APPLETB_CMD_DISP_OFF :
 			    tb_dev->dim_timeout  ==  0 ? APPLETB_CMD_DISP_DIM :
+			    appletb_als_is_dark(tb_dev) ? APPLETB_CMD_DISP_DIM :
 							 APPLETB_CMD_DISP_ON;
 	}
 
+	/* nobody can see or use the touch bar with the lid closed */
+	if (tb_dev->lid_closed || tb_dev->panel_blanked)
+		want_disp = APPLETB_CMD_DISP_OFF;
+
 	/*
 	 * See if we need to update the touch bar, taking into account that we
 	 * generally don't want to switch modes while a touch bar key is
@@ -547,14 +1144,16 @@ static void appletb_update_touchbar_no_lock(struct appletb_device *tb_dev,
 	 */
 	if (appletb_get_cur_tb_mode(tb_dev) != want_mode &&
 	    !appletb_any_tb_key_pressed(tb_dev)) {
-		tb_dev->pnd_tb_mode = want_mode;
+		appletb_set_state_no_lock(tb_dev, &tb_dev->pnd_tb_mode,
+					  want_mode);
 		need_update = true;
 	}
 
 	if (appletb_get_cur_tb_disp(tb_dev) != want_disp &&
 	    (!appletb_any_tb_key_pressed(tb_dev) ||
 	     want_disp != APPLETB_CMD_DISP_OFF)) {
-		tb_dev->pnd_tb_disp = want_disp;
+		appletb_set_state_no_lock(tb_dev, &tb_dev->pnd_tb_disp,
+					  want_disp);
 		need_update = true;
 	}
 
@@ -585,6 +1184,77 @@ static void appletb_update_touchbar(struct appletb_device *tb_dev, bool force)
 	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
 }
 
+/*
+ * Convert a raw reading of the ALS field to lux. The hid core has already
+ * sign-extended the field's unit exponent.
+ */
+static u32 appletb_als_to_lux(struct hid_field *field, s32 value)
+{
+	int exp = field->unit_exponent;
+	u32 lux = max(value, 0);
+
+	for (; exp > 0; exp--) {
+		if (lux > U32_MAX / 10)
+			return U32_MAX;
+		lux *= 10;
+	}
+	for (; exp < 0 && lux; exp++)
+		lux /= 10;
+
+	return lux;
+}
+
+/*
+ * Low-pass filter the ambient light readings and apply hysteresis, so that
+ * the display doesn't flicker between dim and on around the threshold.
+ */
+static void appletb_als_event_no_lock(struct appletb_device *tb_dev, u32 lux)
+{
+	u32 thresh, sample = min_t(u32, lux, U32_MAX >> 8) << 8;
+	bool dark;
+
+	if (!tb_dev->als_valid)
+		tb_dev->als_avg = sample;
+	else if (sample >= tb_dev->als_avg)
+		tb_dev->als_avg += (sample - tb_dev->als_avg) >>
+							APPLETB_ALS_EMA_SHIFT;
+	else
+		tb_dev->als_avg -= (tb_dev->als_avg - sample) >>
+							APPLETB_ALS_EMA_SHIFT;
+
+	tb_dev->als_time = ktime_get();
+	tb_dev->als_valid = true;
+
+	if (tb_dev->als_dim_lux <= 0)
+		return;
+
+	thresh = (u32)tb_dev->als_dim_lux << 8;
+	if (tb_dev->als_dark)
+		dark = tb_dev->als_avg <
+		       thresh + thresh / 100 * APPLETB_ALS_HYST_PCT;
+	else
+		dark = tb_dev->als_avg < thresh;
+
+	if (dark == tb_dev->als_dark)
+		return;
+
+	tb_dev->als_dark = dark;
+
+	/*
+	 * Only touch the display if it's currently lit because of user
+	 * activity; don't turn it back on if it's been dimmed or turned off
+	 * by the idle handling.
+	 */
+	if (appletb_get_cur_tb_disp(tb_dev) == APPLETB_CMD_DISP_OFF)
+		return;
+	if (tb_dev->dim_timeout > 0 &&
+	    ktime_ms_delta(ktime_get(), tb_dev->last_event_time) >=
+						tb_dev->dim_timeout * 1000)
+		return;
+
+	appletb_update_touchbar_no_lock(tb_dev, false);
+}
+
 static void appletb_set_idle_timeout(struct appletb_device *tb_dev, int new)
 {
 	tb_dev->idle_timeout = new;
@@ -684,83 +1354,845 @@ static ssize_t fnmode_store(struct device *dev, struct device_attribute *attr,
 	return size;
 }
 
-static int appletb_tb_key_to_slot(unsigned int code)
-{
-	switch (code) {
-	case KEY_ESC:
-		return 0;
-	case KEY_F1:
-	case KEY_F2:
-	case KEY_F3:
-	case KEY_F4:
-	case KEY_F5:
-	case KEY_F6:
-	case KEY_F7:
-	case KEY_F8:
-	case KEY_F9:
-	case KEY_F10:
-		return code - KEY_F1 + 1;
-	case KEY_F11:
-	case KEY_F12:
-		return code - KEY_F11 + 11;
-	default:
-		return -1;
-	}
-}
+static const struct appletb_config_key {
+	const char	*name;
+	unsigned int	bit;
+	size_t		offset;
+	int		min;
+	int		max;
+} appletb_config_keys[] = {
+	{ "idle_timeout", APPLETB_CFG_IDLE_TIMEOUT,
+	  offsetof(struct appletb_config, idle_timeout), -2, INT_MAX },
+	{ "dim_timeout", APPLETB_CFG_DIM_TIMEOUT,
+	  offsetof(struct appletb_config, dim_timeout), -2, INT_MAX },
+	{ "fnmode", APPLETB_CFG_FN_MODE,
+	  offsetof(struct appletb_config, fn_mode), 0, APPLETB_FN_MODE_MAX },
+	{ "fn_hysteresis_ms", APPLETB_CFG_FN_HYSTERESIS,
+	  offsetof(struct appletb_config, fn_hysteresis_ms), 0, INT_MAX },
+	{ "als_dim_lux", APPLETB_CFG_ALS_DIM_LUX,
+	  offsetof(struct appletb_config, als_dim_lux), 0, INT_MAX / 256 },
+};
 
-static int appletb_hid_event(struct hid_device *hdev, struct hid_field *field,
-			     struct hid_usage *usage, __s32 value)
+/**
+ * appletb_parse_config() - Parse a list of settings.
+ * @buf: whitespace separated list of <name>=<value> pairs
+ * @cfg: where to store the parsed settings
+ *
+ * Returns: 0 on success, or -EINVAL if any of the settings is unknown or
+ * invalid, in which case nothing should be applied.
+ */
+static int appletb_parse_config(const char *buf, struct appletb_config *cfg)
 {
-	struct appletb_device *tb_dev = hid_get_drvdata(hdev);
-	unsigned int new_code = 0;
-	unsigned long flags;
-	bool send_dummy = false;
-	bool send_trnsl = false;
-	int slot;
+	const struct appletb_config_key *key;
+	char *str, *pos, *tok, *val;
+	int value;
 	int rc = 0;
+	int idx;
 
-	if ((usage->hid & HID_USAGE_PAGE) != HID_UP_KEYBOARD ||
-	    usage->type != EV_KEY)
-		return 0;
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
 
-	/*
-	 * Skip non-touch-bar keys.
-	 *
-	 * Either the touch bar itself or usbhid generate a slew of key-down
-	 * events for all the meta keys. None of which we're at all interested
-	 * in.
-	 */
-	slot = appletb_tb_key_to_slot(usage->code);
-	if (slot < 0)
-		return 0;
+	memset(cfg, 0, sizeof(*cfg));
+	pos = str;
 
-	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	while ((tok = strsep(&pos, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
 
-	if (!tb_dev->active) {
-		spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
-		return 0;
-	}
+		val = strchr(tok, '=');
+		if (!val) {
+			rc = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
 
-	new_code = appletb_fn_to_special(usage->code);
+		key = NULL;
+		for (idx = 0; idx < ARRAY_SIZE(appletb_config_keys); idx++) {
+			if (!strcmp(tok, appletb_config_keys[idx].name)) {
+				key = &appletb_config_keys[idx];
+				break;
+			}
+		}
 
-	if (value != 2)
-		tb_dev->last_tb_keys_pressed[slot] = value;
+		if (!key || kstrtoint(val, 0, &value) ||
+		    value < key->min || value > key->max) {
+			rc = -EINVAL;
+			break;
+		}
 
-	tb_dev->last_event_time = ktime_get();
+		*(int *)((u8 *)cfg + key->offset) = value;
+		cfg->mask |= key->bit;
+	}
 
-	appletb_update_touchbar_no_lock(tb_dev, false);
+	kfree(str);
 
-	/*
-	 * We want to suppress touch bar keys while the touch bar is off, but
-	 * we do want to wake up the screen if it's asleep, so generate a dummy
-	 * event in that case.
-	 */
-	if (tb_dev->cur_tb_mode == APPLETB_CMD_MODE_OFF ||
-	    tb_dev->cur_tb_disp == APPLETB_CMD_DISP_OFF) {
-		send_dummy = true;
-		rc = 1;
-	/* translate special keys */
-	} else if (new_code &&
+	return rc;
+}
+
+/*
+ * Apply all the given settings and recompute the touch bar state once, so
+ * no intermediate combination ever reaches the device.
+ */
+static void appletb_apply_config_no_lock(struct appletb_device *tb_dev,
+					 const struct appletb_config *cfg)
+{
+	if (cfg->mask & APPLETB_CFG_IDLE_TIMEOUT)
+		appletb_set_idle_timeout(tb_dev, cfg->idle_timeout);
+	if (cfg->mask & APPLETB_CFG_DIM_TIMEOUT)
+		appletb_set_dim_timeout(tb_dev, cfg->dim_timeout);
+	if (cfg->mask & APPLETB_CFG_FN_MODE)
+		tb_dev->fn_mode = cfg->fn_mode;
+	if (cfg->mask & APPLETB_CFG_FN_HYSTERESIS)
+		WRITE_ONCE(tb_dev->fn_hysteresis_ms, cfg->fn_hysteresis_ms);
+	if ((cfg->mask & APPLETB_CFG_ALS_DIM_LUX) &&
+	    cfg->als_dim_lux != tb_dev->als_dim_lux) {
+		tb_dev->als_dim_lux = cfg->als_dim_lux;
+		tb_dev->als_dark = false;
+		tb_dev->als_valid = false;
+	}
+
+	if (tb_dev->active) {
+		appletb_update_touchbar_no_lock(tb_dev, true);
+		appletb_als_refresh_no_lock(tb_dev);
+	}
+}
+
+static void appletb_apply_config(struct appletb_device *tb_dev,
+				 const struct appletb_config *cfg)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	appletb_apply_config_no_lock(tb_dev, cfg);
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
+/* Capture the current power-source dependent settings. */
+static void appletb_save_profile_no_lock(struct appletb_device *tb_dev,
+					 struct appletb_config *cfg)
+{
+	cfg->mask = APPLETB_CFG_PROFILE;
+	cfg->idle_timeout = tb_dev->idle_timeout;
+	cfg->dim_timeout = tb_dev->dim_to_is_calc ? -2 : tb_dev->dim_timeout;
+	cfg->fn_mode = tb_dev->fn_mode;
+}
+
+/*
+ * Switch between the AC and battery profiles. Changes made through sysfs
+ * while on one power source are kept in that source's profile.
+ */
+static void appletb_psy_worker(struct work_struct *work)
+{
+	struct appletb_device *tb_dev =
+		container_of(work, struct appletb_device, psy_work);
+	unsigned long flags;
+	int profile;
+
+	/* no information about the power supplies counts as AC */
+	profile = IS_REACHABLE(CONFIG_POWER_SUPPLY) &&
+		  power_supply_is_system_supplied() == 0 ?
+			APPLETB_PROFILE_BATTERY : APPLETB_PROFILE_AC;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+
+	if (tb_dev->active && profile != tb_dev->cur_profile) {
+		appletb_save_profile_no_lock(tb_dev,
+				&tb_dev->profiles[tb_dev->cur_profile]);
+		tb_dev->cur_profile = profile;
+		appletb_apply_config_no_lock(tb_dev, &tb_dev->profiles[profile]);
+
+		dev_dbg(tb_dev->log_dev, "Switched to %s profile\n",
+			profile == APPLETB_PROFILE_AC ? "AC" : "battery");
+	}
+
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
+#if IS_REACHABLE(CONFIG_POWER_SUPPLY)
+/* Called in atomic context, so defer to appletb_psy_worker(). */
+static int appletb_psy_notifier_call(struct notifier_block *nb,
+				     unsigned long event, void *data)
+{
+	struct appletb_device *tb_dev =
+		container_of(nb, struct appletb_device, psy_notifier);
+
+	if (event == PSY_EVENT_PROP_CHANGED)
+		schedule_work(&tb_dev->psy_work);
+
+	return NOTIFY_OK;
+}
+
+static int appletb_register_psy_notifier(struct appletb_device *tb_dev)
+{
+	tb_dev->psy_notifier.notifier_call = appletb_psy_notifier_call;
+
+	return power_supply_reg_notifier(&tb_dev->psy_notifier);
+}
+
+static void appletb_unregister_psy_notifier(struct appletb_device *tb_dev)
+{
+	power_supply_unreg_notifier(&tb_dev->psy_notifier);
+}
+#else
+static int appletb_register_psy_notifier(struct appletb_device *tb_dev)
+{
+	return 0;
+}
+
+static void appletb_unregister_psy_notifier(struct appletb_device *tb_dev)
+{
+}
+#endif
+
+static ssize_t power_profile_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%s\n",
+			READ_ONCE(tb_dev->cur_profile) == APPLETB_PROFILE_AC ?
+				"ac" : "battery");
+}
+
+static ssize_t config_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE,
+			"idle_timeout=%d dim_timeout=%d fnmode=%d fn_hysteresis_ms=%d als_dim_lux=%d\n",
+			tb_dev->idle_timeout,
+			tb_dev->dim_to_is_calc ? -2 : tb_dev->dim_timeout,
+			tb_dev->fn_mode, tb_dev->fn_hysteresis_ms,
+			tb_dev->als_dim_lux);
+}
+
+static ssize_t config_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t size)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	struct appletb_config cfg;
+	int rc;
+
+	rc = appletb_parse_config(buf, &cfg);
+	if (rc)
+		return rc;
+
+	appletb_apply_config(tb_dev, &cfg);
+
+	return size;
+}
+
+static ssize_t fn_hysteresis_ms_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", tb_dev->fn_hysteresis_ms);
+}
+
+static ssize_t fn_hysteresis_ms_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t size)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	long new;
+	int rc;
+
+	rc = kstrtol(buf, 0, &new);
+	if (rc || new > INT_MAX || new < 0)
+		return -EINVAL;
+
+	WRITE_ONCE(tb_dev->fn_hysteresis_ms, new);
+
+	return size;
+}
+
+static ssize_t als_dim_lux_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", tb_dev->als_dim_lux);
+}
+
+static ssize_t als_dim_lux_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t size)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	unsigned long flags;
+	long new;
+	int rc;
+
+	rc = kstrtol(buf, 0, &new);
+	if (rc || new > INT_MAX / 256 || new < 0)
+		return -EINVAL;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+
+	tb_dev->als_dim_lux = new;
+	/* re-evaluate on the next reading */
+	tb_dev->als_dark = false;
+	tb_dev->als_valid = false;
+
+	if (tb_dev->active) {
+		appletb_update_touchbar_no_lock(tb_dev, false);
+		appletb_als_refresh_no_lock(tb_dev);
+	}
+
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
+	return size;
+}
+
+/*
+ * Parse a whitespace separated list of <source>=<mask> into rules; sources
+ * not mentioned keep their current value.
+ */
+static int appletb_parse_input_rules(const char *buf, u8 *rules)
+{
+	char *str, *cur, *tok, *val;
+	unsigned int src;
+	int rc = 0;
+	u8 mask;
+
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	cur = strim(str);
+	while ((tok = strsep(&cur, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
+
+		val = strchr(tok, '=');
+		if (!val) {
+			rc = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
+
+		for (src = 0; src < APPLETB_SRC_COUNT; src++)
+			if (!strcmp(tok, appletb_src_names[src]))
+				break;
+
+		if (src == APPLETB_SRC_COUNT || kstrtou8(val, 0, &mask) ||
+		    mask & ~APPLETB_ACT_ALL) {
+			rc = -EINVAL;
+			break;
+		}
+
+		rules[src] = mask;
+	}
+
+	kfree(str);
+	return rc;
+}
+
+static ssize_t input_rules_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	int len = 0;
+	int src;
+
+	for (src = 0; src < APPLETB_SRC_COUNT; src++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%s=%#x",
+				 src ? " " : "", appletb_src_names[src],
+				 READ_ONCE(tb_dev->inp_rules[src]));
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+static ssize_t input_rules_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t size)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	u8 rules[APPLETB_SRC_COUNT];
+	int src;
+	int rc;
+
+	for (src = 0; src < APPLETB_SRC_COUNT; src++)
+		rules[src] = READ_ONCE(tb_dev->inp_rules[src]);
+
+	rc = appletb_parse_input_rules(buf, rules);
+	if (rc)
+		return rc;
+
+	for (src = 0; src < APPLETB_SRC_COUNT; src++)
+		WRITE_ONCE(tb_dev->inp_rules[src], rules[src]);
+
+	return size;
+}
+
+static ssize_t input_sources_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	struct appletb_inp_source *src;
+	unsigned int rate;
+	int len = 0;
+
+	mutex_lock(&tb_dev->inp_lock);
+
+	list_for_each_entry(src, &tb_dev->inp_sources, list) {
+		/* the rate is only updated when events arrive */
+		rate = time_before(jiffies, READ_ONCE(src->window_start) +
+					    2 * HZ) ? READ_ONCE(src->rate) : 0;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%s %s events=%lu activity=%lu rate=%u\n",
+				 dev_name(&src->handle.dev->dev),
+				 appletb_src_names[src->class],
+				 READ_ONCE(src->events),
+				 READ_ONCE(src->activity), rate);
+	}
+
+	mutex_unlock(&tb_dev->inp_lock);
+
+	return len;
+}
+
+static const char *appletb_mode_name(unsigned char mode)
+{
+	switch (mode) {
+	case APPLETB_CMD_MODE_ESC:
+		return "esc";
+	case APPLETB_CMD_MODE_FN:
+		return "fn";
+	case APPLETB_CMD_MODE_SPCL:
+		return "special";
+	case APPLETB_CMD_MODE_OFF:
+		return "off";
+	case APPLETB_CMD_MODE_UPD:
+		return "update";
+	case APPLETB_CMD_MODE_NONE:
+		return "none";
+	default:
+		return "unknown";
+	}
+}
+
+static const char *appletb_disp_name(unsigned char disp)
+{
+	switch (disp) {
+	case APPLETB_CMD_DISP_ON:
+		return "on";
+	case APPLETB_CMD_DISP_DIM:
+		return "dim";
+	case APPLETB_CMD_DISP_OFF:
+		return "off";
+	case APPLETB_CMD_DISP_UPD:
+		return "update";
+	case APPLETB_CMD_DISP_NONE:
+		return "none";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * Lock-free snapshot of the current state, so that monitoring doesn't
+ * contend with the input path. The attribute is pollable: pollers are
+ * woken whenever the mode or display state actually changes.
+ */
+static ssize_t state_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	struct appletb_state state;
+	s64 idle_ms;
+
+	appletb_get_state(tb_dev, &state);
+	idle_ms = ktime_ms_delta(ktime_get(),
+				 READ_ONCE(tb_dev->last_event_time));
+
+	return snprintf(buf, PAGE_SIZE,
+			"mode=%s disp=%s pending_mode=%s pending_disp=%s idle_ms=%lld\n",
+			appletb_mode_name(state.cur_tb_mode),
+			appletb_disp_name(state.cur_tb_disp),
+			appletb_mode_name(state.pnd_tb_mode),
+			appletb_disp_name(state.pnd_tb_disp),
+			idle_ms);
+}
+
+static ssize_t prewake_stats_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	unsigned long hits, misses;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	hits = tb_dev->prewake_hits;
+	misses = tb_dev->prewake_misses;
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
+	return snprintf(buf, PAGE_SIZE, "hits=%lu misses=%lu\n", hits, misses);
+}
+
+static ssize_t first_tap_stats_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	unsigned long delivered, suppressed;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	delivered = tb_dev->first_tap_delivered;
+	suppressed = tb_dev->first_tap_suppressed;
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
+	return snprintf(buf, PAGE_SIZE, "delivered=%lu suppressed=%lu\n",
+			delivered, suppressed);
+}
+
+/*
+ * Whether a touch bar key event received while the touch bar is off should
+ * be delivered rather than suppressed. Key presses are only delivered in
+ * wake_deliver mode and when they are turning the touch bar back on; the
+ * matching repeats and release follow the press.
+ */
+static bool appletb_wake_deliver_no_lock(struct appletb_device *tb_dev,
+					 int slot, __s32 value)
+{
+	bool deliver;
+
+	if (value != 1) {
+		deliver = tb_dev->last_tb_keys_woken[slot];
+		if (value == 0)
+			tb_dev->last_tb_keys_woken[slot] = false;
+		return deliver;
+	}
+
+	deliver = READ_ONCE(appletb_tb_wake_deliver) &&
+		  appletb_get_cur_tb_mode(tb_dev) != APPLETB_CMD_MODE_OFF &&
+		  appletb_get_cur_tb_disp(tb_dev) != APPLETB_CMD_DISP_OFF;
+
+	tb_dev->last_tb_keys_woken[slot] = deliver;
+	if (deliver)
+		tb_dev->first_tap_delivered++;
+	else
+		tb_dev->first_tap_suppressed++;
+
+	return deliver;
+}
+
+static ssize_t residency_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct appletb_device *tb_dev = dev_get_drvdata(dev);
+	u64 mode_ns[APPLETB_NR_MODES];
+	u64 disp_ns[APPLETB_NR_DISPS];
+	unsigned long mode_trans, disp_trans;
+	unsigned long flags;
+	int len = 0;
+	int i;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+
+	/* include the time spent in the current states so far */
+	appletb_account_residency(tb_dev->mode_residency_ns,
+				  tb_dev->cur_tb_mode < APPLETB_NR_MODES ?
+					tb_dev->cur_tb_mode : -1,
+				  &tb_dev->mode_since);
+	appletb_account_residency(tb_dev->disp_residency_ns,
+				  appletb_disp_to_index(tb_dev->cur_tb_disp),
+				  &tb_dev->disp_since);
+
+	memcpy(mode_ns, tb_dev->mode_residency_ns, sizeof(mode_ns));
+	memcpy(disp_ns, tb_dev->disp_residency_ns, sizeof(disp_ns));
+	mode_trans = tb_dev->mode_transitions;
+	disp_trans = tb_dev->disp_transitions;
+
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
+	for (i = 0; i < APPLETB_NR_DISPS; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "disp_%s_ms=%llu ",
+				 appletb_disp_name(appletb_residency_disps[i]),
+				 div_u64(disp_ns[i], NSEC_PER_MSEC));
+	for (i = 0; i < APPLETB_NR_MODES; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "mode_%s_ms=%llu ",
+				 appletb_mode_name(i),
+				 div_u64(mode_ns[i], NSEC_PER_MSEC));
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			 "disp_transitions=%lu mode_transitions=%lu\n",
+			 disp_trans, mode_trans);
+
+	return len;
+}
+
+static int appletb_tb_key_to_slot(unsigned int code)
+{
+	switch (code) {
+	case KEY_ESC:
+		return 0;
+	case KEY_F1:
+	case KEY_F2:
+	case KEY_F3:
+	case KEY_F4:
+	case KEY_F5:
+	case KEY_F6:
+	case KEY_F7:
+	case KEY_F8:
+	case KEY_F9:
+	case KEY_F10:
+		return code - KEY_F1 + 1;
+	case KEY_F11:
+	case KEY_F12:
+		return code - KEY_F11 + 11;
+	default:
+		return -1;
+	}
+}
+
+static void appletb_mt_flush_contact(struct appletb_mt_info *mt)
+{
+	int slot;
+
+	if (!mt->cur_valid)
+		return;
+
+	mt->cur_valid = false;
+
+	slot = input_mt_get_slot_by_key(mt->input, mt->cur_id);
+	if (slot < 0)
+		return;
+
+	input_mt_slot(mt->input, slot);
+	input_mt_report_slot_state(mt->input, MT_TOOL_FINGER, mt->cur_tip);
+	if (mt->cur_tip) {
+		input_report_abs(mt->input, ABS_MT_POSITION_X, mt->cur_x);
+		input_report_abs(mt->input, ABS_MT_POSITION_Y, mt->cur_y);
+	}
+}
+
+/*
+ * Each contact is described by its own logical collection in the report,
+ * so collect the usages of a collection and emit the contact once the next
+ * collection (or the end of the report) is reached.
+ */
+static int appletb_mt_event(struct appletb_mt_info *mt, struct hid_field *field,
+			    struct hid_usage *usage, __s32 value)
+{
+	int delta;
+
+	if (usage->collection_index != mt->cur_collection) {
+		appletb_mt_flush_contact(mt);
+
+		mt->cur_collection = usage->collection_index;
+		mt->cur_id = usage->collection_index;
+		mt->cur_tip = false;
+	}
+
+	switch (usage->hid) {
+	case HID_DG_CONTACTID:
+		mt->cur_id = value;
+		mt->cur_valid = true;
+		break;
+	case HID_DG_TIPSWITCH:
+		mt->cur_tip = !!value;
+		mt->cur_valid = true;
+		break;
+	case HID_GD_X:
+		mt->cur_x = value;
+		mt->cur_valid = true;
+		break;
+	case HID_GD_Y:
+		mt->cur_y = value;
+		mt->cur_valid = true;
+		break;
+	case HID_DG_SCANTIME:
+		if (mt->have_scantime) {
+			delta = value - mt->last_scantime;
+			if (delta < 0)
+				delta += field->logical_maximum + 1;
+			mt->timestamp += delta * APPLETB_MT_SCANTIME_US;
+		}
+		mt->last_scantime = value;
+		mt->have_scantime = true;
+		break;
+	}
+
+	return 1;
+}
+
+static int appletb_hid_report(struct hid_device *hdev,
+			      struct hid_report *report)
+{
+	struct appletb_device *tb_dev = hid_get_drvdata(hdev);
+	struct appletb_mt_info *mt = &tb_dev->mt;
+	unsigned long flags;
+
+	if (report->application != HID_DG_TOUCHPAD || hdev != mt->hdev)
+		return 0;
+
+	appletb_mt_flush_contact(mt);
+	mt->cur_collection = UINT_MAX;
+
+	input_mt_sync_frame(mt->input);
+	input_event(mt->input, EV_MSC, MSC_TIMESTAMP, mt->timestamp);
+	input_sync(mt->input);
+
+	/* touches count as activity just like key presses */
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+
+	if (tb_dev->active) {
+		appletb_prewake_hit_no_lock(tb_dev);
+		WRITE_ONCE(tb_dev->last_event_time, ktime_get());
+		appletb_update_touchbar_no_lock(tb_dev, false);
+		appletb_als_refresh_no_lock(tb_dev);
+	}
+
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
+	return 0;
+}
+
+static int appletb_input_mapping(struct hid_device *hdev,
+				 struct hid_input *hidinput,
+				 struct hid_field *field,
+				 struct hid_usage *usage,
+				 unsigned long **bit, int *max)
+{
+	/* digitizer contacts are reported through our own input device */
+	if (field->application == HID_DG_TOUCHPAD)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Attach point for BPF key policies, see apple-touchbar.h. Runs under
+ * tb_lock. __weak keeps the compiler from propagating the constant return
+ * value into the caller, which would bypass an attached fmod_ret program.
+ */
+__weak noinline int appletb_bpf_key_policy(const struct appletb_bpf_ctx *ctx)
+{
+	return APPLETB_BPF_DEFAULT;
+}
+
+#if defined(CONFIG_BPF_SYSCALL) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+BTF_SET8_START(appletb_bpf_fmodret_ids)
+BTF_ID_FLAGS(func, appletb_bpf_key_policy)
+BTF_SET8_END(appletb_bpf_fmodret_ids)
+
+static const struct btf_kfunc_id_set appletb_bpf_fmodret_set = {
+	.owner = THIS_MODULE,
+	.set = &appletb_bpf_fmodret_ids,
+};
+
+static int __init appletb_bpf_init(void)
+{
+	return register_btf_fmodret_id_set(&appletb_bpf_fmodret_set);
+}
+#else
+static int __init appletb_bpf_init(void)
+{
+	return 0;
+}
+#endif
+
+static int appletb_hid_event(struct hid_device *hdev, struct hid_field *field,
+			     struct hid_usage *usage, __s32 value)
+{
+	struct appletb_device *tb_dev = hid_get_drvdata(hdev);
+	struct appletb_bpf_ctx bpf_ctx;
+	unsigned int new_code = 0;
+	unsigned int bpf_code;
+	unsigned long flags;
+	bool send_dummy = false;
+	bool send_trnsl = false;
+	bool suppress = false;
+	int action;
+	int slot;
+	int rc = 0;
+
+	if (field == tb_dev->als_field) {
+		spin_lock_irqsave(&tb_dev->tb_lock, flags);
+		if (tb_dev->active)
+			appletb_als_event_no_lock(tb_dev,
+					appletb_als_to_lux(field, value));
+		spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+		return 0;
+	}
+
+	if (field->application == HID_DG_TOUCHPAD) {
+		if (hdev != tb_dev->mt.hdev)
+			return 0;
+		return appletb_mt_event(&tb_dev->mt, field, usage, value);
+	}
+
+	if ((usage->hid & HID_USAGE_PAGE) != HID_UP_KEYBOARD ||
+	    usage->type != EV_KEY)
+		return 0;
+
+	/*
+	 * Skip non-touch-bar keys.
+	 *
+	 * Either the touch bar itself or usbhid generate a slew of key-down
+	 * events for all the meta keys. None of which we're at all interested
+	 * in.
+	 */
+	slot = appletb_tb_key_to_slot(usage->code);
+	if (slot < 0)
+		return 0;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+
+	if (!tb_dev->active) {
+		spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+		return 0;
+	}
+
+	new_code = appletb_fn_to_special(usage->code);
+
+	/* a touch bar key pressed while Fn is held commits the switch */
+	if (value == 1 && tb_dev->fn_down && !tb_dev->last_fn_pressed) {
+		cancel_delayed_work(&tb_dev->fn_work);
+		tb_dev->last_fn_pressed = true;
+
+		/*
+		 * Switch modes before this key is recorded as pressed, as that
+		 * would hold off the switch until it is released; this way the
+		 * key is already translated according to the new mode.
+		 */
+		appletb_update_touchbar_no_lock(tb_dev, false);
+	}
+
+	if (value != 2)
+		tb_dev->last_tb_keys_pressed[slot] = value;
+
+	if (value == 1)
+		appletb_prewake_hit_no_lock(tb_dev);
+
+	WRITE_ONCE(tb_dev->last_event_time, ktime_get());
+
+	appletb_update_touchbar_no_lock(tb_dev, false);
+	appletb_als_refresh_no_lock(tb_dev);
+
+	/*
+	 * We want to suppress touch bar keys while the touch bar is off, but
+	 * we do want to wake up the screen if it's asleep, so generate a dummy
+	 * event in that case. In wake_deliver mode the key that turns the
+	 * touch bar on is instead handled as if it already was on.
+	 */
+	if ((tb_dev->cur_tb_mode == APPLETB_CMD_MODE_OFF ||
+	     tb_dev->cur_tb_disp == APPLETB_CMD_DISP_OFF) &&
+	    !appletb_wake_deliver_no_lock(tb_dev, slot, value)) {
+		/* touches through a closed lid shouldn't wake anything */
+		if (tb_dev->lid_closed)
+			suppress = true;
+		else
+			send_dummy = true;
+		rc = 1;
+	/* translate special keys */
+	} else if (new_code &&
 		   ((value > 0 &&
 		     appletb_get_cur_tb_mode(tb_dev) == APPLETB_CMD_MODE_SPCL)
 		    ||
@@ -773,8 +2205,61 @@ static int appletb_hid_event(struct hid_device *hdev, struct hid_field *field,
 		tb_dev->last_tb_keys_translated[slot] = false;
 	}
 
+	/* let a BPF policy override the decision */
+	bpf_ctx = (struct appletb_bpf_ctx) {
+		.code = usage->code,
+		.value = value,
+		.mode = appletb_get_cur_tb_mode(tb_dev),
+		.disp = tb_dev->cur_tb_disp,
+		.fn_mode = tb_dev->fn_mode,
+		.fn_pressed = tb_dev->last_fn_pressed,
+		.was_translated = send_trnsl && value == 0,
+		.default_action = send_dummy ? APPLETB_BPF_SUPPRESS_WAKE :
+				  suppress   ? APPLETB_BPF_SUPPRESS :
+				  send_trnsl ? APPLETB_BPF_TRANSLATE :
+					       APPLETB_BPF_PASS,
+		.default_code = send_trnsl ? new_code : usage->code,
+	};
+
+	action = appletb_bpf_key_policy(&bpf_ctx);
+
+	switch (action & APPLETB_BPF_ACTION_MASK) {
+	case APPLETB_BPF_PASS:
+		send_dummy = send_trnsl = false;
+		tb_dev->last_tb_keys_translated[slot] = false;
+		rc = 0;
+		break;
+	case APPLETB_BPF_TRANSLATE:
+		bpf_code = (unsigned int)action >> APPLETB_BPF_CODE_SHIFT;
+		if (!appletb_is_key_code(bpf_code))
+			break;
+		new_code = bpf_code;
+		send_dummy = false;
+		send_trnsl = true;
+		tb_dev->last_tb_keys_translated[slot] = true;
+		rc = 1;
+		break;
+	case APPLETB_BPF_SUPPRESS:
+		send_dummy = send_trnsl = false;
+		suppress = true;
+		rc = 1;
+		break;
+	case APPLETB_BPF_SUPPRESS_WAKE:
+		send_dummy = true;
+		send_trnsl = false;
+		rc = 1;
+		break;
+	}
+
 	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
 
+	appletb_log_event(tb_dev, APPLETB_EVT_KEY, usage->code,
+			  send_trnsl ? new_code : 0,
+			  send_dummy || suppress ? APPLETB_KEY_SUPPRESSED :
+			  send_trnsl ? APPLETB_KEY_TRANSLATED :
+				       APPLETB_KEY_PASSED,
+			  value);
+
 	/*
 	 * Need to send these input events outside of the lock, as otherwise
 	 * we can run into the following deadlock:
@@ -795,12 +2280,217 @@ static int appletb_hid_event(struct hid_device *hdev, struct hid_field *field,
 	return rc;
 }
 
+/*
+ * With a hysteresis configured, a Fn press only switches the mode once it
+ * has been held long enough (see appletb_fn_worker()) or a touch bar key is
+ * pressed while it's held; a quick tap doesn't touch the mode at all.
+ */
+static void appletb_fn_event_no_lock(struct appletb_device *tb_dev, int value)
+{
+	int hysteresis = READ_ONCE(tb_dev->fn_hysteresis_ms);
+
+	tb_dev->fn_down = value;
+
+	if (!value) {
+		cancel_delayed_work(&tb_dev->fn_work);
+		tb_dev->last_fn_pressed = false;
+	} else if (hysteresis > 0) {
+		mod_delayed_work(system_wq, &tb_dev->fn_work,
+				 msecs_to_jiffies(hysteresis));
+	} else {
+		tb_dev->last_fn_pressed = true;
+	}
+}
+
+static void appletb_fn_worker(struct work_struct *work)
+{
+	struct appletb_device *tb_dev =
+		container_of(work, struct appletb_device, fn_work.work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+
+	if (tb_dev->active && tb_dev->fn_down && !tb_dev->last_fn_pressed) {
+		tb_dev->last_fn_pressed = true;
+		appletb_update_touchbar_no_lock(tb_dev, false);
+	}
+
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
+/*
+ * Force the touch bar display off (lid closed, internal panel blanked) or
+ * release it again. Turning it back on counts as activity, and skips the
+ * usual delay between setting the mode and the display.
+ */
+static void appletb_set_forced_off(struct appletb_device *tb_dev, bool *field,
+				   bool off)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+
+	if (*field == off) {
+		spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+		return;
+	}
+
+	*field = off;
+
+	if (tb_dev->active) {
+		if (!off) {
+			WRITE_ONCE(tb_dev->last_event_time, ktime_get());
+			tb_dev->fast_restore = true;
+		}
+		appletb_update_touchbar_no_lock(tb_dev, false);
+	}
+
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
+/*
+ * Only fbdev/console blanking is seen here, not a compositor's DPMS. And
+ * FB_EVENT_BLANK is gone in newer kernels, where the panel isn't tracked.
+ */
+#if IS_ENABLED(CONFIG_FB_NOTIFY) && defined(FB_EVENT_BLANK)
+static int appletb_fb_notifier_call(struct notifier_block *nb,
+				    unsigned long action, void *data)
+{
+	struct appletb_device *tb_dev =
+		container_of(nb, struct appletb_device, fb_notifier);
+	struct fb_event *evdata = data;
+	struct device *dev;
+	int blank;
+
+	if (action != FB_EVENT_BLANK || !evdata->info ||
+	    !evdata->info->device || !evdata->data)
+		return NOTIFY_DONE;
+
+	/*
+	 * The framebuffer numbering depends on the probe order, so identify
+	 * the internal panel by its device instead: it is never on USB, while
+	 * e.g. the touch bar's own framebuffer (see apple-touchbar-drm) is.
+	 */
+	for (dev = evdata->info->device; dev; dev = dev->parent) {
+		if (dev == tb_dev->parent ||
+		    (dev->type && dev->type->name &&
+		     !strcmp(dev->type->name, "usb_device")))
+			return NOTIFY_DONE;
+	}
+
+	blank = *(int *)evdata->data;
+	appletb_set_forced_off(tb_dev, &tb_dev->panel_blanked,
+			       blank != FB_BLANK_UNBLANK);
+
+	return NOTIFY_OK;
+}
+
+static int appletb_register_fb_notifier(struct appletb_device *tb_dev)
+{
+	tb_dev->fb_notifier.notifier_call = appletb_fb_notifier_call;
+
+	return fb_register_client(&tb_dev->fb_notifier);
+}
+
+static void appletb_unregister_fb_notifier(struct appletb_device *tb_dev)
+{
+	fb_unregister_client(&tb_dev->fb_notifier);
+}
+#else
+static int appletb_register_fb_notifier(struct appletb_device *tb_dev)
+{
+	return 0;
+}
+
+static void appletb_unregister_fb_notifier(struct appletb_device *tb_dev)
+{
+}
+#endif
+
+static unsigned int appletb_inp_event_kind(unsigned int type,
+					   unsigned int code)
+{
+	switch (type) {
+	case EV_KEY:
+		return code >= BTN_MISC && code < KEY_OK ? APPLETB_ACT_BUTTON :
+							   APPLETB_ACT_KEY;
+	case EV_REL:
+	case EV_ABS:
+		return APPLETB_ACT_MOTION;
+	default:
+		return 0;
+	}
+}
+
+static void appletb_inp_account(struct appletb_inp_source *src)
+{
+	unsigned long now = jiffies;
+	unsigned long elapsed = now - src->window_start;
+
+	src->events++;
+
+	/* events per second, over the last complete second */
+	if (elapsed >= HZ) {
+		src->rate = elapsed < 2 * HZ ? src->window_events : 0;
+		src->window_start = now;
+		src->window_events = 0;
+	}
+	src->window_events++;
+}
+
 static void appletb_inp_event(struct input_handle *handle, unsigned int type,
 			      unsigned int code, int value)
 {
-	struct appletb_device *tb_dev = handle->private;
+	struct appletb_inp_source *src =
+		container_of(handle, struct appletb_inp_source, handle);
+	struct appletb_device *tb_dev = src->tb_dev;
+	bool is_fn = src->class == APPLETB_SRC_INT_KBD && type == EV_KEY &&
+		     code == KEY_FN && value != 2;
+	bool activity;
+	unsigned int kind;
 	unsigned long flags;
 
+	if (src->class == APPLETB_SRC_LID) {
+		if (type == EV_SW && code == SW_LID)
+			appletb_set_forced_off(tb_dev, &tb_dev->lid_closed,
+					       value);
+		return;
+	}
+
+	kind = appletb_inp_event_kind(type, code);
+	if (!kind)
+		return;
+
+	appletb_inp_account(src);
+
+	activity = is_fn || (READ_ONCE(tb_dev->inp_rules[src->class]) & kind);
+
+	/*
+	 * A key press or touch that doesn't wake the touch bar by itself
+	 * still predicts touch bar use.
+	 */
+	if (!activity && type == EV_KEY && value == 1 &&
+	    (kind == APPLETB_ACT_KEY || code == BTN_TOUCH) &&
+	    READ_ONCE(appletb_tb_prewake) &&
+	    READ_ONCE(tb_dev->cur_tb_disp) == APPLETB_CMD_DISP_OFF &&
+	    !READ_ONCE(tb_dev->prewake_pending)) {
+		spin_lock_irqsave(&tb_dev->tb_lock, flags);
+		if (tb_dev->active)
+			appletb_prewake_no_lock(tb_dev);
+		spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+	}
+
+	if (!activity)
+		return;
+
+	/* the touch bar state was just updated, no need to redo it */
+	if (!is_fn &&
+	    time_before(jiffies, src->last_activity + APPLETB_ACT_INTERVAL))
+		return;
+
+	src->activity++;
+	src->last_activity = jiffies;
+
 	spin_lock_irqsave(&tb_dev->tb_lock, flags);
 
 	if (!tb_dev->active) {
@@ -808,26 +2498,82 @@ static void appletb_inp_event(struct input_handle *handle, unsigned int type,
 		return;
 	}
 
-	if (type == EV_KEY && code == KEY_FN && value != 2)
-		tb_dev->last_fn_pressed = value;
-
-	tb_dev->last_event_time = ktime_get();
-
-	appletb_update_touchbar_no_lock(tb_dev, false);
+	if (is_fn)
+		appletb_fn_event_no_lock(tb_dev, value);
+
+	WRITE_ONCE(tb_dev->last_event_time, ktime_get());
+
+	appletb_update_touchbar_no_lock(tb_dev, false);
+	appletb_als_refresh_no_lock(tb_dev);
+
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+}
+
+/* Find and save the usb-device associated with the touch bar input device */
+static struct usb_interface *appletb_get_usb_iface(struct hid_device *hdev)
+{
+	struct device *dev = &hdev->dev;
+
+	while (dev && !(dev->type && dev->type->name &&
+			!strcmp(dev->type->name, "usb_interface")))
+		dev = dev->parent;
+
+	return dev ? to_usb_interface(dev) : NULL;
+}
+
+static bool appletb_is_internal_device(struct input_dev *inp_dev)
+{
+	struct appletb_match_entry *entry;
+	struct device *dev = &inp_dev->dev;
+	bool internal = false;
+
+	if (inp_dev->id.bustype == BUS_SPI)
+		return true;
+
+	mutex_lock(&appletb_match_lock);
+
+	list_for_each_entry(entry, &appletb_match_cache, list) {
+		if (!memcmp(&entry->id, &inp_dev->id, sizeof(entry->id))) {
+			internal = entry->internal;
+			goto unlock;
+		}
+	}
+
+	/* in kernel: dev && !is_usb_device(dev) */
+	while (dev && !(dev->type && dev->type->name &&
+			!strcmp(dev->type->name, "usb_device")))
+		dev = dev->parent;
+
+	/*
+	 * Apple labels all their internal keyboards and trackpads as such,
+	 * instead of maintaining an ever expanding list of product-id's we
+	 * just look at the device's product name.
+	 */
+	if (dev && to_usb_device(dev)->product)
+		internal = !!strstr(to_usb_device(dev)->product,
+				    "Internal Keyboard");
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (entry) {
+		entry->id = inp_dev->id;
+		entry->internal = internal;
+		list_add(&entry->list, &appletb_match_cache);
+	}
+
+unlock:
+	mutex_unlock(&appletb_match_lock);
 
-	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+	return internal;
 }
 
-/* Find and save the usb-device associated with the touch bar input device */
-static struct usb_interface *appletb_get_usb_iface(struct hid_device *hdev)
+static void appletb_free_match_cache(void)
 {
-	struct device *dev = &hdev->dev;
+	struct appletb_match_entry *entry, *tmp;
 
-	while (dev && !(dev->type && dev->type->name &&
-			!strcmp(dev->type->name, "usb_interface")))
-		dev = dev->parent;
-
-	return dev ? to_usb_interface(dev) : NULL;
+	list_for_each_entry_safe(entry, tmp, &appletb_match_cache, list) {
+		list_del(&entry->list);
+		kfree(entry);
+	}
 }
 
 static int appletb_inp_connect(struct input_handler *handler,
@@ -835,28 +2581,38 @@ static int appletb_inp_connect(struct input_handler *handler,
 			       const struct input_device_id *id)
 {
 	struct appletb_device *tb_dev = handler->private;
+	struct appletb_inp_source *src;
 	struct input_handle *handle;
+	bool internal;
 	int rc;
 
-	if (id->driver_info == APPLETB_DEVID_KEYBOARD) {
-		handle = &tb_dev->kbd_handle;
-		handle->name = "tbkbd";
-	} else if (id->driver_info == APPLETB_DEVID_TOUCHPAD) {
-		handle = &tb_dev->tpd_handle;
-		handle->name = "tbtpad";
-	} else {
+	if (id->driver_info != APPLETB_DEVID_KEYBOARD &&
+	    id->driver_info != APPLETB_DEVID_POINTER &&
+	    id->driver_info != APPLETB_DEVID_LID) {
 		dev_err(tb_dev->log_dev, "Unknown device id (%lu)\n",
 			id->driver_info);
 		return -ENOENT;
 	}
 
-	if (handle->dev) {
-		dev_err(tb_dev->log_dev,
-			"Duplicate connect to %s input device\n", handle->name);
-		return -EEXIST;
-	}
+	src = kzalloc(sizeof(*src), GFP_KERNEL);
+	if (!src)
+		return -ENOMEM;
 
-	handle->open = 0;
+	internal = appletb_is_internal_device(dev);
+	if (id->driver_info == APPLETB_DEVID_LID)
+		src->class = APPLETB_SRC_LID;
+	else if (id->driver_info == APPLETB_DEVID_KEYBOARD)
+		src->class = internal ? APPLETB_SRC_INT_KBD :
+					APPLETB_SRC_EXT_KBD;
+	else
+		src->class = internal ? APPLETB_SRC_INT_PTR :
+					APPLETB_SRC_EXT_PTR;
+	src->tb_dev = tb_dev;
+	src->window_start = jiffies;
+	src->last_activity = jiffies - APPLETB_ACT_INTERVAL;
+
+	handle = &src->handle;
+	handle->name = appletb_src_names[src->class];
 	handle->dev = input_get_device(dev);
 	handle->handler = handler;
 	handle->private = tb_dev;
@@ -869,8 +2625,16 @@ static int appletb_inp_connect(struct input_handler *handler,
 	if (rc)
 		goto err_unregister_handle;
 
-	dev_dbg(tb_dev->log_dev, "Connected to %s input device\n",
-		handle == &tb_dev->kbd_handle ? "keyboard" : "touchpad");
+	mutex_lock(&tb_dev->inp_lock);
+	list_add_tail(&src->list, &tb_dev->inp_sources);
+	mutex_unlock(&tb_dev->inp_lock);
+
+	if (src->class == APPLETB_SRC_LID)
+		appletb_set_forced_off(tb_dev, &tb_dev->lid_closed,
+				       test_bit(SW_LID, dev->sw));
+
+	dev_dbg(tb_dev->log_dev, "Connected to %s input device %s\n",
+		handle->name, dev_name(&dev->dev));
 
 	return 0;
 
@@ -878,28 +2642,37 @@ static int appletb_inp_connect(struct input_handler *handler,
 	input_unregister_handle(handle);
  err_free_dev:
 	input_put_device(handle->dev);
-	handle->dev = NULL;
+	kfree(src);
 	return rc;
 }
 
 static void appletb_inp_disconnect(struct input_handle *handle)
 {
-	struct appletb_device *tb_dev = handle->private;
+	struct appletb_inp_source *src =
+		container_of(handle, struct appletb_inp_source, handle);
+	struct appletb_device *tb_dev = src->tb_dev;
+
+	mutex_lock(&tb_dev->inp_lock);
+	list_del(&src->list);
+	mutex_unlock(&tb_dev->inp_lock);
 
 	input_close_device(handle);
 	input_unregister_handle(handle);
 
-	dev_dbg(tb_dev->log_dev, "Disconnected from %s input device\n",
-		handle == &tb_dev->kbd_handle ? "keyboard" : "touchpad");
+	if (src->class == APPLETB_SRC_LID)
+		appletb_set_forced_off(tb_dev, &tb_dev->lid_closed, false);
+
+	dev_dbg(tb_dev->log_dev, "Disconnected from %s input device %s\n",
+		handle->name, dev_name(&handle->dev->dev));
 
 	input_put_device(handle->dev);
-	handle->dev = NULL;
+	kfree(src);
 }
 
 static int appletb_input_configured(struct hid_device *hdev,
 				    struct hid_input *hidinput)
 {
-	int idx;
+	unsigned int code;
 	struct input_dev *input = hidinput->input;
 
 	/*
@@ -915,14 +2688,15 @@ static int appletb_input_configured(struct hid_device *hdev,
 	__set_bit(EV_REP, input->evbit);
 	__set_bit(EV_MSC, input->evbit);  /* hid-input generates MSC_SCAN */
 
-	for (idx = 0; idx < ARRAY_SIZE(appletb_fn_codes); idx++) {
-		input_set_capability(input, EV_KEY, appletb_fn_codes[idx].from);
-		input_set_capability(input, EV_KEY, appletb_fn_codes[idx].to);
+	/*
+	 * Besides ESC, the function keys and their translations, a BPF key
+	 * policy may translate to any other key.
+	 */
+	for (code = 0; code <= KEY_MAX; code++) {
+		if (appletb_is_key_code(code))
+			__set_bit(code, input->keybit);
 	}
 
-	input_set_capability(input, EV_KEY, KEY_ESC);
-	input_set_capability(input, EV_KEY, KEY_UNKNOWN);
-
 	return 0;
 }
 
@@ -1013,6 +2787,16 @@ static int appletb_extract_report_and_iface_info(struct appletb_device *tb_dev,
 		iface_info = &tb_dev->mode_iface;
 		tb_dev->mode_field = field;
 		tb_dev->is_t1 = !!(id->driver_data & APPLETB_FEATURE_IS_T1);
+
+		/*
+		 * On the T1 the iBridge forwards the ambient light sensor's
+		 * reports to the touch bar device too.
+		 */
+		if (tb_dev->is_t1)
+			WRITE_ONCE(tb_dev->als_field,
+				   appletb_find_hid_field(hdev,
+						HID_USAGE_SENSOR_ALS,
+						HID_USAGE_SENSOR_LIGHT_ILLUM));
 	} else {
 		field = appletb_find_hid_field(hdev, HID_USAGE_APPLE_APP,
 					       HID_USAGE_DISP);
@@ -1051,11 +2835,90 @@ static int appletb_extract_report_and_iface_info(struct appletb_device *tb_dev,
 	return 1;
 }
 
+/*
+ * In the OS X configuration the iBridge reports raw touches instead of key
+ * presses; expose those as a multitouch device so that continuous gestures
+ * (sliders etc) can be implemented without going through key repeats.
+ */
+static int appletb_mt_init(struct appletb_device *tb_dev,
+			   struct hid_device *hdev)
+{
+	struct appletb_mt_info *mt = &tb_dev->mt;
+	struct hid_field *x_field, *y_field;
+	struct input_dev *input;
+	int rc;
+
+	x_field = appletb_find_hid_field(hdev, HID_DG_TOUCHPAD, HID_GD_X);
+	y_field = appletb_find_hid_field(hdev, HID_DG_TOUCHPAD, HID_GD_Y);
+	if (!x_field || !y_field)
+		return 0;
+
+	input = devm_input_allocate_device(&hdev->dev);
+	if (!input)
+		return -ENOMEM;
+
+	input->name = "Apple Touch Bar Digitizer";
+	input->phys = hdev->phys;
+	input->uniq = hdev->uniq;
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->id.version = hdev->version;
+	input->dev.parent = &hdev->dev;
+
+	input_set_abs_params(input, ABS_MT_POSITION_X,
+			     x_field->logical_minimum, x_field->logical_maximum,
+			     0, 0);
+	input_abs_set_res(input, ABS_MT_POSITION_X,
+			  hidinput_calc_abs_res(x_field, ABS_MT_POSITION_X));
+	input_set_abs_params(input, ABS_MT_POSITION_Y,
+			     y_field->logical_minimum, y_field->logical_maximum,
+			     0, 0);
+	input_abs_set_res(input, ABS_MT_POSITION_Y,
+			  hidinput_calc_abs_res(y_field, ABS_MT_POSITION_Y));
+	input_set_capability(input, EV_MSC, MSC_TIMESTAMP);
+
+	rc = input_mt_init_slots(input, APPLETB_MT_MAX_CONTACTS,
+				 INPUT_MT_DIRECT | INPUT_MT_DROP_UNUSED);
+	if (rc) {
+		dev_err(tb_dev->log_dev,
+			"Failed to initialize multitouch slots (%d)\n", rc);
+		return rc;
+	}
+
+	rc = input_register_device(input);
+	if (rc) {
+		dev_err(tb_dev->log_dev,
+			"Failed to register digitizer input device (%d)\n", rc);
+		return rc;
+	}
+
+	mt->cur_collection = UINT_MAX;
+	mt->cur_valid = false;
+	mt->have_scantime = false;
+	mt->timestamp = 0;
+	mt->input = input;
+	mt->hdev = hdev;
+
+	return 0;
+}
+
 static void appletb_clear_iface_info(struct appletb_device *tb_dev,
 				     struct hid_device *hdev)
 {
 	struct appletb_iface_info *iface_info;
 
+	if (tb_dev->als_field && tb_dev->als_field->report->device == hdev) {
+		WRITE_ONCE(tb_dev->als_field, NULL);
+		cancel_work_sync(&tb_dev->als_work);
+	}
+
+	/* the input device itself is devm-managed */
+	if (tb_dev->mt.hdev == hdev) {
+		tb_dev->mt.hdev = NULL;
+		tb_dev->mt.input = NULL;
+	}
+
 	iface_info = appletb_get_iface_info(tb_dev, hdev);
 	if (iface_info) {
 		usb_put_intf(iface_info->usb_iface);
@@ -1105,75 +2968,284 @@ static bool appletb_test_and_mark_inactive(struct appletb_device *tb_dev,
 
 static const struct input_device_id appletb_input_devices[] = {
 	{
-		.flags = INPUT_DEVICE_ID_MATCH_BUS |
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
 			INPUT_DEVICE_ID_MATCH_KEYBIT,
-		.bustype = BUS_SPI,
+		.evbit = { BIT_MASK(EV_KEY) },
 		.keybit = { [BIT_WORD(KEY_FN)] = BIT_MASK(KEY_FN) },
 		.driver_info = APPLETB_DEVID_KEYBOARD,
-	},			/* Builtin SPI keyboard device */
-	{
-		.flags = INPUT_DEVICE_ID_MATCH_BUS |
-			INPUT_DEVICE_ID_MATCH_KEYBIT,
-		.bustype = BUS_SPI,
-		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
-		.driver_info = APPLETB_DEVID_TOUCHPAD,
-	},			/* Builtin SPI touchpad device */
+	},			/* Builtin keyboards */
 	{
-		.flags = INPUT_DEVICE_ID_MATCH_BUS |
-			INPUT_DEVICE_ID_MATCH_VENDOR |
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
 			INPUT_DEVICE_ID_MATCH_KEYBIT,
-		.bustype = BUS_USB,
-		.vendor = 0x05ac /* USB_VENDOR_ID_APPLE */,
-		.keybit = { [BIT_WORD(KEY_FN)] = BIT_MASK(KEY_FN) },
+		.evbit = { BIT_MASK(EV_KEY) },
+		.keybit = { [BIT_WORD(KEY_A)] = BIT_MASK(KEY_A) },
 		.driver_info = APPLETB_DEVID_KEYBOARD,
-	},			/* Builtin USB keyboard device */
+	},			/* Other keyboards */
 	{
-		.flags = INPUT_DEVICE_ID_MATCH_BUS |
-			INPUT_DEVICE_ID_MATCH_VENDOR |
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
 			INPUT_DEVICE_ID_MATCH_KEYBIT,
-		.bustype = BUS_USB,
-		.vendor = 0x05ac /* USB_VENDOR_ID_APPLE */,
+		.evbit = { BIT_MASK(EV_KEY) },
 		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
-		.driver_info = APPLETB_DEVID_TOUCHPAD,
-	},			/* Builtin USB touchpad device */
+		.driver_info = APPLETB_DEVID_POINTER,
+	},			/* Touchpads */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			INPUT_DEVICE_ID_MATCH_KEYBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+		.keybit = { [BIT_WORD(BTN_LEFT)] = BIT_MASK(BTN_LEFT) },
+		.driver_info = APPLETB_DEVID_POINTER,
+	},			/* Mice */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			INPUT_DEVICE_ID_MATCH_SWBIT,
+		.evbit = { BIT_MASK(EV_SW) },
+		.swbit = { [BIT_WORD(SW_LID)] = BIT_MASK(SW_LID) },
+		.driver_info = APPLETB_DEVID_LID,
+	},			/* Lid switch */
 	{ },			/* Terminating zero entry */
 };
 
-static bool appletb_match_internal_device(struct input_handler *handler,
-					  struct input_dev *inp_dev)
+static bool appletb_match_device(struct input_handler *handler,
+				 struct input_dev *inp_dev)
 {
-	struct device *dev = &inp_dev->dev;
+	struct appletb_device *tb_dev = handler->private;
+	struct device *parent = inp_dev->dev.parent;
+
+	/* don't count our own touch bar and digitizer devices */
+	if (parent &&
+	    ((tb_dev->mode_iface.hdev &&
+	      parent == &tb_dev->mode_iface.hdev->dev) ||
+	     (tb_dev->disp_iface.hdev &&
+	      parent == &tb_dev->disp_iface.hdev->dev) ||
+	     (tb_dev->mt.hdev && parent == &tb_dev->mt.hdev->dev)))
+		return false;
+
+	return true;
+}
 
-	if (inp_dev->id.bustype == BUS_SPI)
-		return true;
+/*
+ * Find the device that the interfaces of one touch bar have in common. On
+ * the T1 both interfaces are on the same (iBridge) usb device; on the T2 the
+ * display and the backlight are separate usb devices behind the same hub.
+ */
+static struct device *appletb_get_parent(struct hid_device *hdev,
+					 const struct hid_device_id *id)
+{
+	struct usb_interface *usb_iface;
+	struct usb_device *udev;
 
-	/* in kernel: dev && !is_usb_device(dev) */
-	while (dev && !(dev->type && dev->type->name &&
-			!strcmp(dev->type->name, "usb_device")))
-		dev = dev->parent;
+	usb_iface = appletb_get_usb_iface(hdev);
+	if (!usb_iface)
+		return NULL;
 
-	/*
-	 * Apple labels all their internal keyboards and trackpads as such,
-	 * instead of maintaining an ever expanding list of product-id's we
-	 * just look at the device's product name.
-	 */
-	if (dev)
-		return !!strstr(to_usb_device(dev)->product, "Internal Keyboard");
+	udev = interface_to_usbdev(usb_iface);
 
-	return false;
+	if (id->driver_data & APPLETB_FEATURE_IS_T1)
+		return &udev->dev;
+
+	return udev->dev.parent;
+}
+
+static struct appletb_device *appletb_alloc_device(struct device *parent)
+{
+	struct appletb_device *tb_dev;
+
+	tb_dev = kzalloc(sizeof(*tb_dev), GFP_KERNEL);
+	if (!tb_dev)
+		return NULL;
+
+	tb_dev->ring_size = PAGE_SIZE +
+		PAGE_ALIGN(APPLETB_RING_RECORDS * sizeof(struct appletb_event));
+	tb_dev->ring = vmalloc_user(tb_dev->ring_size);
+	if (!tb_dev->ring) {
+		kfree(tb_dev);
+		return NULL;
+	}
+
+	tb_dev->ring->version = APPLETB_RING_VERSION;
+	tb_dev->ring->record_size = sizeof(struct appletb_event);
+	tb_dev->ring->nr_records = APPLETB_RING_RECORDS;
+	tb_dev->ring->data_offset = PAGE_SIZE;
+	tb_dev->ring_data = (void *)tb_dev->ring + PAGE_SIZE;
+	spin_lock_init(&tb_dev->ring_lock);
+	init_waitqueue_head(&tb_dev->ring_wait);
+
+	tb_dev->parent = get_device(parent);
+	tb_dev->log_dev = tb_dev->parent;
+	kref_init(&tb_dev->kref);
+	spin_lock_init(&tb_dev->tb_lock);
+	seqcount_spinlock_init(&tb_dev->state_seq, &tb_dev->tb_lock);
+	INIT_DELAYED_WORK(&tb_dev->tb_work, appletb_set_tb_worker);
+	INIT_WORK(&tb_dev->als_work, appletb_als_worker);
+	INIT_DELAYED_WORK(&tb_dev->fn_work, appletb_fn_worker);
+	INIT_DELAYED_WORK(&tb_dev->prewake_work, appletb_prewake_worker);
+	INIT_WORK(&tb_dev->psy_work, appletb_psy_worker);
+	/* unknown until confirmed, so that no residency is accounted yet */
+	tb_dev->cur_tb_mode = APPLETB_CMD_MODE_NONE;
+	tb_dev->cur_tb_disp = APPLETB_CMD_DISP_NONE;
+	tb_dev->mode_since = ktime_get();
+	tb_dev->disp_since = tb_dev->mode_since;
+	INIT_LIST_HEAD(&tb_dev->inp_sources);
+	mutex_init(&tb_dev->inp_lock);
+
+	return tb_dev;
+}
+
+static void appletb_free_device(struct appletb_device *tb_dev)
+{
+	cancel_delayed_work_sync(&tb_dev->tb_work);
+	cancel_work_sync(&tb_dev->als_work);
+	cancel_delayed_work_sync(&tb_dev->fn_work);
+	cancel_delayed_work_sync(&tb_dev->prewake_work);
+	cancel_work_sync(&tb_dev->psy_work);
+	put_device(tb_dev->parent);
+	vfree(tb_dev->ring);
+	kfree(tb_dev);
+}
+
+/**
+ * appletb_get_device() - Get the touch bar instance for the given parent,
+ * creating it if this is the first of its interfaces to be probed.
+ * @parent: the device common to all the touch bar's interfaces
+ *
+ * Returns: the referenced touch bar instance, or NULL if out of memory.
+ */
+static struct appletb_device *appletb_get_device(struct device *parent)
+{
+	struct appletb_device *tb_dev;
+
+	mutex_lock(&appletb_devices_lock);
+
+	list_for_each_entry(tb_dev, &appletb_devices, list) {
+		if (tb_dev->parent == parent) {
+			kref_get(&tb_dev->kref);
+			goto unlock;
+		}
+	}
+
+	tb_dev = appletb_alloc_device(parent);
+	if (tb_dev)
+		list_add_tail(&tb_dev->list, &appletb_devices);
+
+unlock:
+	mutex_unlock(&appletb_devices_lock);
+
+	return tb_dev;
+}
+
+static void appletb_release_device(struct kref *kref)
+	__releases(&appletb_devices_lock)
+{
+	struct appletb_device *tb_dev =
+		container_of(kref, struct appletb_device, kref);
+
+	list_del(&tb_dev->list);
+	mutex_unlock(&appletb_devices_lock);
+
+	appletb_free_device(tb_dev);
+}
+
+static void appletb_put_device(struct appletb_device *tb_dev)
+{
+	kref_put_mutex(&tb_dev->kref, appletb_release_device,
+		       &appletb_devices_lock);
+}
+
+static int appletb_events_open(struct inode *inode, struct file *file)
+{
+	struct miscdevice *misc = file->private_data;
+	struct appletb_device *tb_dev =
+		container_of(misc, struct appletb_device, events_dev);
+
+	/* misc_deregister() can't complete while we're here */
+	kref_get(&tb_dev->kref);
+	file->private_data = tb_dev;
+
+	return 0;
+}
+
+static int appletb_events_release(struct inode *inode, struct file *file)
+{
+	struct appletb_device *tb_dev = file->private_data;
+
+	appletb_put_device(tb_dev);
+
+	return 0;
+}
+
+static int appletb_events_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct appletb_device *tb_dev = file->private_data;
+
+	return remap_vmalloc_range(vma, tb_dev->ring, vma->vm_pgoff);
+}
+
+static __poll_t appletb_events_poll(struct file *file, poll_table *wait)
+{
+	struct appletb_device *tb_dev = file->private_data;
+
+	poll_wait(file, &tb_dev->ring_wait, wait);
+
+	if (READ_ONCE(tb_dev->ring_head) != READ_ONCE(tb_dev->ring->tail))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations appletb_events_fops = {
+	.owner = THIS_MODULE,
+	.open = appletb_events_open,
+	.release = appletb_events_release,
+	.mmap = appletb_events_mmap,
+	.poll = appletb_events_poll,
+	.llseek = noop_llseek,
+};
+
+static int appletb_register_events_dev(struct appletb_device *tb_dev)
+{
+	int rc;
+
+	rc = ida_alloc(&appletb_events_ida, GFP_KERNEL);
+	if (rc < 0)
+		return rc;
+
+	tb_dev->events_dev_id = rc;
+	snprintf(tb_dev->events_dev_name, sizeof(tb_dev->events_dev_name),
+		 "appletb-events%d", tb_dev->events_dev_id);
+
+	tb_dev->events_dev.minor = MISC_DYNAMIC_MINOR;
+	tb_dev->events_dev.name = tb_dev->events_dev_name;
+	tb_dev->events_dev.fops = &appletb_events_fops;
+	tb_dev->events_dev.parent = tb_dev->parent;
+
+	rc = misc_register(&tb_dev->events_dev);
+	if (rc) {
+		ida_free(&appletb_events_ida, tb_dev->events_dev_id);
+		return rc;
+	}
+
+	return 0;
+}
+
+static void appletb_unregister_events_dev(struct appletb_device *tb_dev)
+{
+	misc_deregister(&tb_dev->events_dev);
+	ida_free(&appletb_events_ida, tb_dev->events_dev_id);
 }
 
 static int appletb_probe(struct hid_device *hdev,
 			 const struct hid_device_id *id)
 {
-	struct appletb_device *tb_dev = appletb_dev;
+	struct appletb_device *tb_dev;
+	struct kernfs_node *kn;
+	struct device *parent;
 	unsigned long flags;
 	int rc;
 
 	/* initialize the report info */
 	rc = hid_parse(hdev);
 	if (rc) {
-		dev_err(tb_dev->log_dev, "hid parse failed (%d)\n", rc);
+		dev_err(&hdev->dev, "hid parse failed (%d)\n", rc);
 		goto error;
 	}
 
@@ -1186,18 +3258,29 @@ static int appletb_probe(struct hid_device *hdev,
 		return -ENODEV;
 	}
 
-	spin_lock_irqsave(&tb_dev->tb_lock, flags);
-
-	if (!tb_dev->log_dev)
-		tb_dev->log_dev = &hdev->dev;
+	parent = appletb_get_parent(hdev, id);
+	if (!parent) {
+		dev_err(&hdev->dev, "Failed to find usb device for hid device %s\n",
+			dev_name(&hdev->dev));
+		rc = -ENODEV;
+		goto error;
+	}
 
-	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+	tb_dev = appletb_get_device(parent);
+	if (!tb_dev) {
+		rc = -ENOMEM;
+		goto error;
+	}
 
 	hid_set_drvdata(hdev, tb_dev);
 
 	rc = appletb_extract_report_and_iface_info(tb_dev, hdev, id);
 	if (rc < 0)
-		goto error;
+		goto put_device;
+
+	rc = appletb_mt_init(tb_dev, hdev);
+	if (rc)
+		goto clear_iface_info;
 
 	rc = hid_hw_start(hdev, HID_CONNECT_DRIVER | HID_CONNECT_HIDINPUT);
 	if (rc) {
@@ -1221,10 +3304,45 @@ static int appletb_probe(struct hid_device *hdev,
 			tb_dev->fn_mode = APPLETB_FN_MODE_NORM;
 		appletb_set_idle_timeout(tb_dev, appletb_tb_def_idle_timeout);
 		appletb_set_dim_timeout(tb_dev, appletb_tb_def_dim_timeout);
-		tb_dev->last_event_time = ktime_get();
+		tb_dev->fn_hysteresis_ms =
+			max(appletb_tb_def_fn_hysteresis_ms, 0);
+		tb_dev->als_dim_lux = max(appletb_tb_def_als_dim_lux, 0);
+		memcpy(tb_dev->inp_rules, appletb_def_inp_rules,
+		       sizeof(tb_dev->inp_rules));
+		if (appletb_tb_def_input_rules &&
+		    appletb_parse_input_rules(appletb_tb_def_input_rules,
+					      tb_dev->inp_rules)) {
+			dev_warn(tb_dev->log_dev,
+				 "Invalid input_rules parameter, using defaults\n");
+			memcpy(tb_dev->inp_rules, appletb_def_inp_rules,
+			       sizeof(tb_dev->inp_rules));
+		}
 
-		tb_dev->pnd_tb_mode = APPLETB_CMD_MODE_UPD;
-		tb_dev->pnd_tb_disp = APPLETB_CMD_DISP_UPD;
+		/* start on AC, the worker switches if needed */
+		tb_dev->cur_profile = APPLETB_PROFILE_AC;
+		appletb_save_profile_no_lock(tb_dev,
+				&tb_dev->profiles[APPLETB_PROFILE_AC]);
+		tb_dev->profiles[APPLETB_PROFILE_BATTERY] =
+			tb_dev->profiles[APPLETB_PROFILE_AC];
+		if (appletb_tb_bat_idle_timeout >= -2)
+			tb_dev->profiles[APPLETB_PROFILE_BATTERY].idle_timeout =
+				appletb_tb_bat_idle_timeout;
+		if (appletb_tb_bat_dim_timeout >= -2)
+			tb_dev->profiles[APPLETB_PROFILE_BATTERY].dim_timeout =
+				appletb_tb_bat_dim_timeout;
+		if (appletb_tb_bat_fn_mode >= 0 &&
+		    appletb_tb_bat_fn_mode <= APPLETB_FN_MODE_MAX)
+			tb_dev->profiles[APPLETB_PROFILE_BATTERY].fn_mode =
+				appletb_tb_bat_fn_mode;
+
+		WRITE_ONCE(tb_dev->last_event_time, ktime_get());
+
+		spin_lock_irqsave(&tb_dev->tb_lock, flags);
+		appletb_set_state_no_lock(tb_dev, &tb_dev->pnd_tb_mode,
+					  APPLETB_CMD_MODE_UPD);
+		appletb_set_state_no_lock(tb_dev, &tb_dev->pnd_tb_disp,
+					  APPLETB_CMD_DISP_UPD);
+		spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
 
 		appletb_update_touchbar(tb_dev, false);
 
@@ -1234,7 +3352,7 @@ static int appletb_probe(struct hid_device *hdev,
 		tb_dev->inp_handler.disconnect = appletb_inp_disconnect;
 		tb_dev->inp_handler.name = "appletb";
 		tb_dev->inp_handler.id_table = appletb_input_devices;
-		tb_dev->inp_handler.match = appletb_match_internal_device;
+		tb_dev->inp_handler.match = appletb_match_device;
 		tb_dev->inp_handler.private = tb_dev;
 
 		rc = input_register_handler(&tb_dev->inp_handler);
@@ -1254,21 +3372,67 @@ static int appletb_probe(struct hid_device *hdev,
 			goto unreg_handler;
 		}
 
+		rc = appletb_register_events_dev(tb_dev);
+		if (rc) {
+			dev_err(tb_dev->log_dev,
+				"Failed to register event stream device (%d)\n",
+				rc);
+			goto remove_attrs;
+		}
+
+		kn = sysfs_get_dirent(tb_dev->mode_iface.hdev->dev.kobj.sd,
+				      "state");
+		spin_lock_irqsave(&tb_dev->tb_lock, flags);
+		tb_dev->state_kn = kn;
+		spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
+		rc = appletb_register_fb_notifier(tb_dev);
+		if (rc)
+			dev_warn(tb_dev->log_dev,
+				 "Failed to register framebuffer notifier (%d), not tracking panel blanking\n",
+				 rc);
+
+		rc = appletb_register_psy_notifier(tb_dev);
+		if (rc)
+			dev_warn(tb_dev->log_dev,
+				 "Failed to register power supply notifier (%d), not switching profiles\n",
+				 rc);
+		schedule_work(&tb_dev->psy_work);
+
 		dev_dbg(tb_dev->log_dev, "Touchbar activated\n");
 	}
 
 	return 0;
 
+remove_attrs:
+	sysfs_remove_group(&tb_dev->mode_iface.hdev->dev.kobj,
+			   &appletb_attr_group);
 unreg_handler:
 	input_unregister_handler(&tb_dev->inp_handler);
 mark_inactive:
 	appletb_test_and_mark_inactive(tb_dev, hdev);
+	/* input seen meanwhile may have queued work, as in appletb_remove() */
+	cancel_work_sync(&tb_dev->psy_work);
+	cancel_work_sync(&tb_dev->als_work);
+	cancel_delayed_work_sync(&tb_dev->fn_work);
 	cancel_delayed_work_sync(&tb_dev->tb_work);
+	cancel_delayed_work_sync(&tb_dev->prewake_work);
+
+	spin_lock_irqsave(&tb_dev->tb_lock, flags);
+	appletb_prewake_release_no_lock(tb_dev, false);
+	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
+	if (tb_dev->tb_autopm_off) {
+		hid_hw_power(tb_dev->disp_iface.hdev, PM_HINT_NORMAL);
+		tb_dev->tb_autopm_off = false;
+	}
 	hid_hw_close(hdev);
 stop_hid:
 	hid_hw_stop(hdev);
 clear_iface_info:
 	appletb_clear_iface_info(tb_dev, hdev);
+put_device:
+	appletb_put_device(tb_dev);
 error:
 	return rc;
 }
@@ -1276,15 +3440,34 @@ error:
 static void appletb_remove(struct hid_device *hdev)
 {
 	struct appletb_device *tb_dev = hid_get_drvdata(hdev);
+	struct kernfs_node *kn;
 	unsigned long flags;
 
 	if (appletb_test_and_mark_inactive(tb_dev, hdev)) {
+		spin_lock_irqsave(&tb_dev->tb_lock, flags);
+		kn = tb_dev->state_kn;
+		tb_dev->state_kn = NULL;
+		spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+		sysfs_put(kn);
+
+		appletb_unregister_psy_notifier(tb_dev);
+		cancel_work_sync(&tb_dev->psy_work);
+		appletb_unregister_fb_notifier(tb_dev);
+		appletb_unregister_events_dev(tb_dev);
+
 		sysfs_remove_group(&tb_dev->mode_iface.hdev->dev.kobj,
 				   &appletb_attr_group);
 
 		input_unregister_handler(&tb_dev->inp_handler);
 
+		cancel_delayed_work_sync(&tb_dev->fn_work);
 		cancel_delayed_work_sync(&tb_dev->tb_work);
+		cancel_delayed_work_sync(&tb_dev->prewake_work);
+
+		spin_lock_irqsave(&tb_dev->tb_lock, flags);
+		appletb_prewake_release_no_lock(tb_dev, false);
+		spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+
 		appletb_set_tb_mode(tb_dev, APPLETB_CMD_MODE_OFF);
 		appletb_set_tb_disp(tb_dev, APPLETB_CMD_DISP_ON);
 
@@ -1298,18 +3481,7 @@ static void appletb_remove(struct hid_device *hdev)
 	hid_hw_stop(hdev);
 	appletb_clear_iface_info(tb_dev, hdev);
 
-	spin_lock_irqsave(&tb_dev->tb_lock, flags);
-
-	if (tb_dev->log_dev == &hdev->dev) {
-		if (tb_dev->mode_iface.hdev)
-			tb_dev->log_dev = &tb_dev->mode_iface.hdev->dev;
-		else if (tb_dev->disp_iface.hdev)
-			tb_dev->log_dev = &tb_dev->disp_iface.hdev->dev;
-		else
-			tb_dev->log_dev = NULL;
-	}
-
-	spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
+	appletb_put_device(tb_dev);
 }
 
 #ifdef CONFIG_PM
@@ -1369,8 +3541,10 @@ static int appletb_suspend(struct hid_device *hdev, pm_message_t message)
 
 		spin_lock_irqsave(&tb_dev->tb_lock, flags);
 
-		tb_dev->cur_tb_mode = APPLETB_CMD_MODE_OFF;
-		tb_dev->cur_tb_disp = APPLETB_CMD_DISP_OFF;
+		appletb_set_state_no_lock(tb_dev, &tb_dev->cur_tb_mode,
+					  APPLETB_CMD_MODE_OFF);
+		appletb_set_state_no_lock(tb_dev, &tb_dev->cur_tb_disp,
+					  APPLETB_CMD_DISP_OFF);
 
 		spin_unlock_irqrestore(&tb_dev->tb_lock, flags);
 
@@ -1402,7 +3576,7 @@ static int appletb_reset_resume(struct hid_device *hdev)
 		 */
 		tb_dev->active = true;
 		tb_dev->restore_autopm = true;
-		tb_dev->last_event_time = ktime_get();
+		WRITE_ONCE(tb_dev->last_event_time, ktime_get());
 
 		appletb_update_touchbar_no_lock(tb_dev, true);
 
@@ -1415,26 +3589,6 @@ static int appletb_reset_resume(struct hid_device *hdev)
 }
 #endif
 
-static struct appletb_device *appletb_alloc_device(void)
-{
-	struct appletb_device *tb_dev;
-
-	tb_dev = kzalloc(sizeof(*tb_dev), GFP_KERNEL);
-	if (!tb_dev)
-		return NULL;
-
-	spin_lock_init(&tb_dev->tb_lock);
-	INIT_DELAYED_WORK(&tb_dev->tb_work, appletb_set_tb_worker);
-
-	return tb_dev;
-}
-
-static void appletb_free_device(struct appletb_device *tb_dev)
-{
-	cancel_delayed_work_sync(&tb_dev->tb_work);
-	kfree(tb_dev);
-}
-
 static const struct hid_device_id appletb_hid_ids[] = {
 	/* MacBook Pro's 2016, 2017, with T1 chip */
 	{ HID_USB_DEVICE(USB_VENDOR_ID_LINUX_FOUNDATION,
@@ -1457,6 +3611,8 @@ static struct hid_driver appletb_hid_driver = {
 	.probe = appletb_probe,
 	.remove = appletb_remove,
 	.event = appletb_hid_event,
+	.report = appletb_hid_report,
+	.input_mapping = appletb_input_mapping,
 	.input_configured = appletb_input_configured,
 #ifdef CONFIG_PM
 	.suspend = appletb_suspend,
@@ -1466,30 +3622,20 @@ static struct hid_driver appletb_hid_driver = {
 
 static int __init appletb_init(void)
 {
-	struct appletb_device *tb_dev;
 	int rc;
 
-	tb_dev = appletb_alloc_device();
-	if (!tb_dev)
-		return -ENOMEM;
-
-	appletb_dev = tb_dev;
-
-	rc = hid_register_driver(&appletb_hid_driver);
+	rc = appletb_bpf_init();
 	if (rc)
-		goto error;
-
-	return 0;
+		pr_warn("tb: Failed to register BPF key policy hook (%d)\n",
+			rc);
 
-error:
-	appletb_free_device(tb_dev);
-	return rc;
+	return hid_register_driver(&appletb_hid_driver);
 }
 
 static void __exit appletb_exit(void)
 {
 	hid_unregister_driver(&appletb_hid_driver);
-	appletb_free_device(appletb_dev);
+	appletb_free_match_cache();
 }
 
 module_init(appletb_init);
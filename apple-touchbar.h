@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Apple Touch Bar Driver
+ *
+ * Copyright (c) 2017-2018 Ronald Tschalär
+ */
+
+#ifndef __LINUX_APPLE_TOUCHBAR_H
+#define __LINUX_APPLE_TOUCHBAR_H
+
+#include <linux/types.h>
+
+/* touch bar modes and display states, as sent to the device */
+#define APPLETB_CMD_MODE_ESC	0
+#define APPLETB_CMD_MODE_FN	1
+#define APPLETB_CMD_MODE_SPCL	2
+#define APPLETB_CMD_MODE_OFF	3
+#define APPLETB_CMD_MODE_UPD	254
+#define APPLETB_CMD_MODE_NONE	255
+
+#define APPLETB_CMD_DISP_ON	1
+#define APPLETB_CMD_DISP_DIM	2
+#define APPLETB_CMD_DISP_OFF	4
+#define APPLETB_CMD_DISP_UPD	254
+#define APPLETB_CMD_DISP_NONE	255
+
+/*
+ * Event stream, available via /dev/appletb-events<N>. The device is
+ * mmap'd to get a ring of fixed size records, preceded by a header page:
+ *
+ *   struct appletb_ring_header	at offset 0
+ *   struct appletb_event[]	at offset data_offset, nr_records entries
+ *
+ * The driver writes record (head % nr_records) and then increments head.
+ * The (single) consumer reads records from tail up to head, and then
+ * stores the new tail in the header; poll() reports the device readable
+ * while head != tail. The ring is overwritten when the consumer falls
+ * behind, which it can detect by (head - tail > nr_records).
+ */
+
+#define APPLETB_RING_VERSION	1
+
+struct appletb_ring_header {
+	__u32	version;
+	__u32	record_size;
+	__u32	nr_records;
+	__u32	data_offset;
+	__u64	head;		/* written by the driver */
+	__u64	tail;		/* written by the consumer */
+};
+
+#define APPLETB_EVT_KEY		1	/* touch bar key */
+#define APPLETB_EVT_MODE	2	/* confirmed mode change */
+#define APPLETB_EVT_DISP	3	/* confirmed display change */
+#define APPLETB_EVT_TIMEOUT	4	/* dim or idle timeout reached */
+
+/* what was done with a touch bar key (APPLETB_EVT_KEY) */
+#define APPLETB_KEY_PASSED	0	/* delivered unchanged */
+#define APPLETB_KEY_TRANSLATED	1	/* delivered as new_code */
+#define APPLETB_KEY_SUPPRESSED	2	/* dropped, touch bar was off */
+
+struct appletb_event {
+	__u64	timestamp;	/* CLOCK_MONOTONIC, in ns */
+	__u16	type;		/* APPLETB_EVT_* */
+	/*
+	 * KEY: the key code; MODE/DISP: the new state; TIMEOUT: the
+	 * display state being switched to.
+	 */
+	__u16	code;
+	/* KEY: the translated key code; MODE/DISP: the previous state */
+	__u16	aux;
+	__u8	action;		/* KEY: APPLETB_KEY_* */
+	__u8	reserved1;
+	/* KEY: the key value; TIMEOUT: the timeout, in seconds */
+	__s32	value;
+	__u32	reserved2;
+};
+
+/*
+ * Key policy hook. A BPF program attached with fmod_ret to
+ * appletb_bpf_key_policy() is called for every touch bar key event, with
+ * the decision the built-in policy would make filled in, and can override
+ * it by returning one of the following. Any key code may be translated to;
+ * button codes (BTN_*) and codes beyond KEY_MAX are not, and leave the
+ * built-in decision in place.
+ */
+#define APPLETB_BPF_DEFAULT		0	/* apply the built-in policy */
+#define APPLETB_BPF_PASS		1	/* deliver the key unchanged */
+#define APPLETB_BPF_TRANSLATE		2	/* deliver it as another key */
+#define APPLETB_BPF_SUPPRESS		3	/* drop the key */
+#define APPLETB_BPF_SUPPRESS_WAKE	4	/* drop it, but wake the screen */
+
+#define APPLETB_BPF_ACTION_MASK		0xffff
+#define APPLETB_BPF_CODE_SHIFT		16
+#define APPLETB_BPF_TRANSLATE_TO(code) \
+	(((code) << APPLETB_BPF_CODE_SHIFT) | APPLETB_BPF_TRANSLATE)
+
+struct appletb_bpf_ctx {
+	__u16	code;		/* the key code */
+	__s32	value;		/* 0 = release, 1 = press, 2 = repeat */
+	__u8	mode;		/* APPLETB_CMD_MODE_*, including pending */
+	__u8	disp;		/* APPLETB_CMD_DISP_*, device-confirmed */
+	__u8	fn_mode;	/* see the fnmode attribute */
+	__u8	fn_pressed;
+	/* whether the press of this key was delivered translated */
+	__u8	was_translated;
+	/* the built-in decision: an APPLETB_BPF_* action and its key code */
+	__u8	default_action;
+	__u16	default_code;
+};
+
+#ifdef __KERNEL__
+int appletb_bpf_key_policy(const struct appletb_bpf_ctx *ctx);
+#endif
+
+#endif
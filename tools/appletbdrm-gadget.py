@@ -0,0 +1,422 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+#
+# Stand-in for the T2 touch bar display, for testing apple-touchbar-drm
+# without the hardware. The protocol is the one implemented by the appletbdrm
+# driver (Copyright (c) 2023 Kerem Karabay <kekrby@gmail.com>), which
+# apple-touchbar-drm follows.
+#
+# This sets up a USB gadget (via configfs and FunctionFS) that looks like
+# the iBridge display interface - 05ac:8302 with a vendor interface of class
+# USB_CLASS_AUDIO_VIDEO and a pair of bulk endpoints - and answers the
+# driver's messages the way the device does. Every frame update is checked
+# against the panel and logged, so damage handling and pacing can be
+# observed; the resulting image can be dumped as a PPM.
+#
+# Use it with dummy_hcd to loop the gadget back to the local host:
+#
+#   modprobe dummy_hcd
+#   modprobe libcomposite
+#   modprobe usb_f_fs
+#   ./appletbdrm-gadget.py --dump /tmp/touchbar.ppm
+#
+# and then load apple-touchbar-drm, which binds to the new device.
+
+import argparse
+import errno
+import os
+import signal
+import struct
+import subprocess
+import sys
+import threading
+
+CONFIGFS = '/sys/kernel/config/usb_gadget'
+
+USB_VENDOR_ID_APPLE = 0x05ac
+USB_DEVICE_ID_APPLE_TOUCHBAR_DISPLAY = 0x8302
+USB_CLASS_AUDIO_VIDEO = 0x10
+
+# functionfs
+FUNCTIONFS_DESCRIPTORS_MAGIC_V2 = 3
+FUNCTIONFS_STRINGS_MAGIC = 2
+FUNCTIONFS_HAS_FS_DESC = 1
+FUNCTIONFS_HAS_HS_DESC = 2
+FUNCTIONFS_EVENT_SIZE = 12
+FUNCTIONFS_EVENTS = ('BIND', 'UNBIND', 'ENABLE', 'DISABLE', 'SETUP',
+                     'SUSPEND', 'RESUME')
+
+# protocol, see apple-touchbar-drm.c
+MSG_CLEAR_DISPLAY = 0x434c5244          # CLRD
+MSG_GET_INFORMATION = 0x47494e46        # GINF
+MSG_UPDATE_COMPLETE = 0x5544434c        # UDCL
+MSG_SIGNAL_READINESS = 0x52454459       # REDY
+
+REQUEST_HEADER = struct.Struct('<HHIII')
+SIMPLE_REQUEST = struct.Struct('<16sI8sI')
+FB_REQUEST = struct.Struct('<16sHB29s')
+FRAME = struct.Struct('<HHHHI')
+FOOTER_SIZE = 0x50
+FOOTER_TIMESTAMP = 0x20
+RESPONSE_HEADER = struct.Struct('<16sI')
+INFORMATION = struct.Struct('<16sI12sIIBIIIIff')
+FB_RESPONSE = struct.Struct('<16sI12sQ')
+
+BYTES_PER_PIXEL = 3
+DPI = 218
+
+
+class ProtocolError(Exception):
+    pass
+
+
+def fourcc(msg):
+    return struct.pack('>I', msg).decode('ascii', 'replace')
+
+
+def write_attr(path, value):
+    with open(path, 'w') as f:
+        f.write(value)
+
+
+class Panel:
+    """The display; kept in landscape (i.e. mode) orientation."""
+
+    def __init__(self, width, height):
+        # the native orientation is portrait, as reported by GINF
+        self.native_width = width
+        self.native_height = height
+        self.width = height
+        self.height = width
+        self.pixels = bytearray(self.width * self.height * BYTES_PER_PIXEL)
+        self.updates = 0
+        self.bytes = 0
+        self.lock = threading.Lock()
+
+    def clear(self):
+        with self.lock:
+            self.pixels[:] = bytes(len(self.pixels))
+
+    def update(self, begin_x, begin_y, width, height, buf):
+        # undo the rotation applied by the driver
+        rect_x1 = self.width - (begin_y + height)
+        rect_y1 = begin_x
+        rect_w = height
+        rect_h = width
+
+        if (not rect_w or not rect_h or rect_x1 < 0 or
+                begin_x + width > self.native_width):
+            raise ProtocolError('frame %ux%u at %u,%u outside of %ux%u panel'
+                                % (width, height, begin_x, begin_y,
+                                   self.native_width, self.native_height))
+
+        line_len = rect_w * BYTES_PER_PIXEL
+        pitch = self.width * BYTES_PER_PIXEL
+        with self.lock:
+            for y in range(rect_h):
+                dst = (rect_y1 + y) * pitch + rect_x1 * BYTES_PER_PIXEL
+                self.pixels[dst:dst + line_len] = \
+                    buf[y * line_len:(y + 1) * line_len]
+            self.updates += 1
+            self.bytes += len(buf)
+
+        return rect_x1, rect_y1, rect_w, rect_h
+
+    def dump(self, path):
+        with self.lock:
+            rgb = bytearray(self.pixels)
+        # the device takes BGR888
+        rgb[0::3], rgb[2::3] = rgb[2::3], rgb[0::3]
+        with open(path, 'wb') as f:
+            f.write(b'P6\n%d %d\n255\n' % (self.width, self.height))
+            f.write(rgb)
+
+
+class Device:
+    """Answers the driver's requests."""
+
+    def __init__(self, panel, fail_every, verbose):
+        self.panel = panel
+        self.fail_every = fail_every
+        self.verbose = verbose
+        self.frames = 0
+
+    def log(self, fmt, *args):
+        print('tbgadget: ' + fmt % args, flush=True)
+
+    def handle(self, msg):
+        """Returns the response to the request in msg."""
+        _, kind, _, _, _ = REQUEST_HEADER.unpack_from(msg)
+        if kind == 0x1512:
+            return self.handle_simple(msg)
+        if kind == 0x12:
+            return self.handle_frame(msg)
+        raise ProtocolError('unknown request type %#x' % kind)
+
+    def handle_simple(self, msg):
+        if len(msg) != SIMPLE_REQUEST.size:
+            raise ProtocolError('simple request of %u bytes' % len(msg))
+
+        _, cmd, _, _ = SIMPLE_REQUEST.unpack_from(msg)
+        self.log('%s', fourcc(cmd))
+
+        if cmd == MSG_GET_INFORMATION:
+            p = self.panel
+            return INFORMATION.pack(
+                bytes(16), cmd, bytes(12), p.native_width, p.native_height,
+                BYTES_PER_PIXEL * 8, p.native_width * BYTES_PER_PIXEL, 0, 0,
+                0, p.native_width / DPI, p.native_height / DPI)
+
+        if cmd == MSG_CLEAR_DISPLAY:
+            self.panel.clear()
+        elif cmd != MSG_SIGNAL_READINESS:
+            raise ProtocolError('unknown message %#x' % cmd)
+
+        return RESPONSE_HEADER.pack(bytes(16), cmd)
+
+    def handle_frame(self, msg):
+        off = FB_REQUEST.size
+        begin_x, begin_y, width, height, buf_size = \
+            FRAME.unpack_from(msg, off)
+        off += FRAME.size
+
+        if buf_size != width * height * BYTES_PER_PIXEL:
+            raise ProtocolError('frame %ux%u with %u bytes'
+                                % (width, height, buf_size))
+        if len(msg) != off + buf_size + FOOTER_SIZE:
+            raise ProtocolError('frame request of %u bytes, expected %u'
+                                % (len(msg), off + buf_size + FOOTER_SIZE))
+
+        x, y, w, h = self.panel.update(begin_x, begin_y, width, height,
+                                       msg[off:off + buf_size])
+        off += buf_size
+
+        (timestamp,) = struct.unpack_from('<Q', msg, off + FOOTER_TIMESTAMP)
+
+        self.frames += 1
+        if self.verbose:
+            self.log('update %u: %ux%u at %u,%u (%u bytes)',
+                     self.frames, w, h, x, y, buf_size)
+
+        if self.fail_every and self.frames % self.fail_every == 0:
+            self.log('update %u: failing', self.frames)
+            timestamp ^= 1
+
+        return FB_RESPONSE.pack(bytes(16), MSG_UPDATE_COMPLETE, bytes(12),
+                                timestamp)
+
+
+def descriptors():
+    def interface():
+        return struct.pack('<BBBBBBBBB', 9, 4, 0, 0, 2,
+                           USB_CLASS_AUDIO_VIDEO, 0, 0, 1)
+
+    def endpoint(addr, max_packet):
+        return struct.pack('<BBBBHB', 7, 5, addr, 2, max_packet, 0)
+
+    # ep1 is the bulk-in endpoint, ep2 the bulk-out one
+    fs = interface() + endpoint(0x81, 64) + endpoint(0x02, 64)
+    hs = interface() + endpoint(0x81, 512) + endpoint(0x02, 512)
+    body = struct.pack('<II', 3, 3) + fs + hs
+    return struct.pack('<III', FUNCTIONFS_DESCRIPTORS_MAGIC_V2,
+                       12 + len(body),
+                       FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC) + body
+
+
+def strings():
+    body = struct.pack('<IIH', 1, 1, 0x0409) + b'Touch Bar Display\0'
+    return struct.pack('<II', FUNCTIONFS_STRINGS_MAGIC, 8 + len(body)) + body
+
+
+class Gadget:
+    """The configfs gadget with a single FunctionFS function."""
+
+    def __init__(self, name, mountpoint):
+        self.path = os.path.join(CONFIGFS, name)
+        self.function = os.path.join(self.path, 'functions', 'ffs.' + name)
+        self.config = os.path.join(self.path, 'configs', 'c.1')
+        self.mountpoint = mountpoint
+        self.name = name
+        self.mounted = False
+
+    def create(self):
+        os.mkdir(self.path)
+        write_attr(os.path.join(self.path, 'idVendor'),
+                   '%#06x' % USB_VENDOR_ID_APPLE)
+        write_attr(os.path.join(self.path, 'idProduct'),
+                   '%#06x' % USB_DEVICE_ID_APPLE_TOUCHBAR_DISPLAY)
+        write_attr(os.path.join(self.path, 'bcdUSB'), '0x0200')
+
+        strs = os.path.join(self.path, 'strings', '0x409')
+        os.mkdir(strs)
+        write_attr(os.path.join(strs, 'manufacturer'), 'Apple Inc.')
+        write_attr(os.path.join(strs, 'product'), 'Touch Bar Display')
+        write_attr(os.path.join(strs, 'serialnumber'), '0')
+
+        os.mkdir(self.config)
+        os.mkdir(os.path.join(self.config, 'strings', '0x409'))
+        write_attr(os.path.join(self.config, 'strings', '0x409',
+                                'configuration'), 'Touch Bar Display')
+
+        os.mkdir(self.function)
+        os.symlink(self.function,
+                   os.path.join(self.config, os.path.basename(self.function)))
+
+        os.makedirs(self.mountpoint, exist_ok=True)
+        subprocess.run(['mount', '-t', 'functionfs', self.name,
+                        self.mountpoint], check=True)
+        self.mounted = True
+
+    def bind(self, udc):
+        if not udc:
+            udcs = sorted(os.listdir('/sys/class/udc'))
+            if not udcs:
+                raise RuntimeError('no UDC found; is dummy_hcd loaded?')
+            udc = udcs[0]
+        write_attr(os.path.join(self.path, 'UDC'), udc)
+        return udc
+
+    def unbind(self):
+        try:
+            write_attr(os.path.join(self.path, 'UDC'), '\n')
+        except OSError:
+            pass
+
+    def destroy(self):
+        def quietly(fn, *args):
+            try:
+                fn(*args)
+            except OSError:
+                pass
+
+        if self.mounted:
+            subprocess.run(['umount', self.mountpoint])
+        quietly(os.unlink,
+                os.path.join(self.config, os.path.basename(self.function)))
+        quietly(os.rmdir, os.path.join(self.config, 'strings', '0x409'))
+        quietly(os.rmdir, self.config)
+        quietly(os.rmdir, self.function)
+        quietly(os.rmdir, os.path.join(self.path, 'strings', '0x409'))
+        quietly(os.rmdir, self.path)
+
+
+def ep0_events(ep0, device):
+    while True:
+        try:
+            event = os.read(ep0, FUNCTIONFS_EVENT_SIZE)
+        except OSError:
+            return
+        if len(event) != FUNCTIONFS_EVENT_SIZE:
+            return
+
+        kind = event[8]
+        name = (FUNCTIONFS_EVENTS[kind] if kind < len(FUNCTIONFS_EVENTS)
+                else str(kind))
+        device.log('%s', name.lower())
+
+        # the driver doesn't use any control requests: stall them
+        if name == 'SETUP':
+            try:
+                if event[0] & 0x80:
+                    os.read(ep0, 0)
+                else:
+                    os.write(ep0, b'')
+            except OSError:
+                pass
+
+
+def serve(ep_in, ep_out, device, packet_size):
+    """Reads requests from the out endpoint and answers them."""
+    buf = bytearray()
+
+    while True:
+        try:
+            # requests aren't zero-length terminated, so read by packet
+            # and split them up by the size in their header
+            buf += os.read(ep_out, packet_size)
+
+            while len(buf) >= REQUEST_HEADER.size:
+                size = REQUEST_HEADER.unpack_from(buf)[4]
+                end = REQUEST_HEADER.size + size
+                if len(buf) < end:
+                    break
+
+                msg = bytes(buf[:end])
+                del buf[:end]
+
+                try:
+                    resp = device.handle(msg)
+                except ProtocolError as e:
+                    device.log('error: %s', e)
+                    continue
+
+                os.write(ep_in, resp)
+        except OSError as e:
+            if e.errno != errno.ESHUTDOWN:
+                raise
+            # the host went away or reconfigured: start over
+            buf.clear()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Emulate the T2 touch bar display for apple-touchbar-drm.')
+    parser.add_argument('--name', default='appletbdrm',
+                        help='name of the gadget and its function')
+    parser.add_argument('--mountpoint', default='/dev/ffs-appletbdrm',
+                        help='where to mount the FunctionFS instance')
+    parser.add_argument('--udc', help='UDC to bind to [first one found]')
+    parser.add_argument('--width', type=int, default=60,
+                        help='native (portrait) panel width [60]')
+    parser.add_argument('--height', type=int, default=2170,
+                        help='native (portrait) panel height [2170]')
+    parser.add_argument('--packet-size', type=int, default=512,
+                        help='bulk max packet size of the link [512]')
+    parser.add_argument('--fail-every', type=int, default=0, metavar='N',
+                        help='answer every Nth update with a bad response')
+    parser.add_argument('--dump', metavar='FILE',
+                        help='write the panel contents to FILE as a PPM on '
+                        'SIGUSR1 and on exit')
+    parser.add_argument('-q', '--quiet', action='store_true',
+                        help="don't log every update")
+    args = parser.parse_args()
+
+    panel = Panel(args.width, args.height)
+    device = Device(panel, args.fail_every, not args.quiet)
+    gadget = Gadget(args.name, args.mountpoint)
+    fds = []
+
+    if args.dump:
+        signal.signal(signal.SIGUSR1, lambda sig, frame: panel.dump(args.dump))
+
+    try:
+        gadget.create()
+
+        ep0 = os.open(os.path.join(args.mountpoint, 'ep0'), os.O_RDWR)
+        fds.append(ep0)
+        os.write(ep0, descriptors())
+        os.write(ep0, strings())
+        threading.Thread(target=ep0_events, args=(ep0, device),
+                         daemon=True).start()
+
+        ep_in = os.open(os.path.join(args.mountpoint, 'ep1'), os.O_WRONLY)
+        ep_out = os.open(os.path.join(args.mountpoint, 'ep2'), os.O_RDONLY)
+        fds += [ep_in, ep_out]
+
+        device.log('bound to %s', gadget.bind(args.udc))
+        serve(ep_in, ep_out, device, args.packet_size)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        gadget.unbind()
+        for fd in reversed(fds):
+            os.close(fd)
+        gadget.destroy()
+        if args.dump:
+            panel.dump(args.dump)
+        device.log('%u updates, %u bytes of pixel data',
+                   panel.updates, panel.bytes)
+
+
+if __name__ == '__main__':
+    sys.exit(main())